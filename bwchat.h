@@ -3,19 +3,41 @@
 
 #define BWC_MESSAGE_LENGTH (32 * 1024)
 #define BWC_NICK_LENGTH 32
+#define BWC_MESSAGE_COUNT 20
+#define BWC_SEARCH_RESULTS 50
 
 enum bwchat_command {
   BWC_CMD_ADD_MESSAGE,
   BWC_CMD_ALL_MESSAGES,
   BWC_CMD_NEW_MESSAGES,
-  BWC_CMD_AUDIO_STREAM
+  BWC_CMD_AUDIO_STREAM,
+  /* Requested by a new bwchat-server process, to take over the
+     listening socket, listeners, and history. */
+  BWC_CMD_HANDOVER,
+  /* Like BWC_CMD_ALL_MESSAGES followed by BWC_CMD_NEW_MESSAGES, but
+     without a gap between the two: used by relays. */
+  BWC_CMD_REPLICATE,
+  /* Followed by a query: words to find in archived messages. Up to
+     BWC_SEARCH_RESULTS matching messages are sent in response, the
+     most recent ones first. */
+  BWC_CMD_SEARCH,
+  /* Like BWC_CMD_AUDIO_STREAM, but for the room mix of all the audio
+     streams, if the server mixes them. */
+  BWC_CMD_ROOM_STREAM,
+  /* Like BWC_CMD_NEW_MESSAGES, but the listener also receives
+     heartbeats while idle (as with BWC_CMD_REPLICATE). */
+  BWC_CMD_NEW_MESSAGES_HEARTBEAT
 };
 
 enum bwchat_message_type {
   BWC_MESSAGE_NONE,
   BWC_MESSAGE_TEXT,
+  /* The data is a stored (content-addressed) file name, followed by
+     the zero byte and an original file name to display. */
   BWC_MESSAGE_UPLOAD,
-  BWC_MESSAGE_AUDIO
+  BWC_MESSAGE_AUDIO,
+  /* An audio stream that has not been updated for a while. */
+  BWC_MESSAGE_AUDIO_ENDED
 };
 
 struct bwchat_message {
@@ -25,3 +47,24 @@ struct bwchat_message {
   char data[BWC_MESSAGE_LENGTH];
   size_t data_len;
 };
+
+/* The length of a message's header: the fields preceding its data. */
+#define BWC_MESSAGE_HEADER_LENGTH offsetof(struct bwchat_message, data)
+
+/* Message listeners that ask for it (with
+   BWC_CMD_NEW_MESSAGES_HEARTBEAT, or BWC_CMD_REPLICATE) periodically
+   receive heartbeats while idle: messages of the BWC_MESSAGE_NONE
+   type, truncated to this length. */
+#define BWC_HEARTBEAT_LENGTH BWC_MESSAGE_HEADER_LENGTH
+
+/* The message history, as published by bwchat-server in a POSIX
+   shared memory object, for read-only mapping by clients. The seq
+   counter is odd while the history is being updated: a reader should
+   retry if it was odd, or if it changed while the messages were being
+   read. The object is unlinked (so its link count drops to zero) once
+   the server is gone. */
+struct bwchat_history {
+  volatile unsigned long seq;
+  unsigned int oldest;
+  struct bwchat_message messages[BWC_MESSAGE_COUNT];
+};
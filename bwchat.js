@@ -9,6 +9,12 @@
 var mediaRecorder = null;
 var streamButton = null;
 
+// Files are uploaded in chunks of this size, a few at once, so that
+// an interrupted upload is resumed rather than restarted.
+const UPLOAD_CHUNK_SIZE = 1024 * 1024;
+const UPLOAD_PARALLEL = 4;
+const UPLOAD_RETRIES = 5;
+
 function handleDataAvailable(event) {
     if (event.data.size > 0) {
         const formData  = new FormData();
@@ -46,6 +52,81 @@ function stream() {
     }
 }
 
+// Issues a resumable upload request, resolving to the response text.
+function uploadRequest(params, options) {
+    return fetch("upload?" + new URLSearchParams(params), options)
+        .then((response) => {
+            if (! response.ok) {
+                throw new Error("Upload request failed: " + response.status);
+            }
+            return response.text();
+        });
+}
+
+// Sends a chunk of a file, retrying with exponential backoff.
+function uploadChunk(id, file, offset, attempt) {
+    const body = file.slice(offset, offset + UPLOAD_CHUNK_SIZE);
+    return uploadRequest({ action: "chunk", id: id, offset: offset },
+                         { method: "PUT", body: body })
+        .catch((err) => {
+            if (attempt >= UPLOAD_RETRIES) {
+                throw err;
+            }
+            return new Promise((resolve) =>
+                setTimeout(resolve, 1000 * 2 ** attempt))
+                .then(() => uploadChunk(id, file, offset, attempt + 1));
+        });
+}
+
+// Lists offsets of the chunks not received yet, given a status
+// response: the file size, followed by "offset length" lines of the
+// received ranges.
+function missingChunks(size, status) {
+    const ranges = status.trim().split("\n").slice(1)
+          .map((line) => line.split(" ").map(Number));
+    const missing = [];
+    for (let offset = 0; offset < size; offset += UPLOAD_CHUNK_SIZE) {
+        const end = Math.min(offset + UPLOAD_CHUNK_SIZE, size);
+        if (! ranges.some(([o, l]) => o <= offset && o + l >= end)) {
+            missing.push(offset);
+        }
+    }
+    return missing;
+}
+
+// Uploads a file in chunks, resuming an earlier attempt to upload the
+// same file, if there was one.
+function uploadFile(file, nick) {
+    const key = ["bwchat-upload", file.name, file.size, file.lastModified]
+          .join(" ");
+    const saved = localStorage.getItem(key);
+    const resumed = saved === null ? Promise.resolve(null) :
+          uploadRequest({ action: "status", id: saved })
+          .then((status) => ({ id: saved, status: status }))
+          .catch(() => null);
+    return resumed
+        .then((session) => session ||
+              uploadRequest({ action: "create", size: file.size,
+                              name: file.name }, { method: "POST" })
+              .then((id) => {
+                  localStorage.setItem(key, id.trim());
+                  return { id: id.trim(), status: "" };
+              }))
+        .then(({ id, status }) => {
+            const queue = missingChunks(file.size, status);
+            const worker = () => queue.length == 0 ? Promise.resolve() :
+                  uploadChunk(id, file, queue.shift(), 0).then(worker);
+            const workers = [];
+            for (let i = 0; i < UPLOAD_PARALLEL; i++) {
+                workers.push(worker());
+            }
+            return Promise.all(workers)
+                .then(() => uploadRequest({ action: "finish", id: id,
+                                            nick: nick }, { method: "POST" }))
+                .then(() => localStorage.removeItem(key));
+        });
+}
+
 addEventListener("DOMContentLoaded", (event) => {
     // Set the streaming button
     streamButton = document.createElement("input");
@@ -60,6 +141,14 @@ addEventListener("DOMContentLoaded", (event) => {
     chatInputForm.addEventListener("submit", function (e) {
         var nick = document.getElementsByName("nick")[0];
         var message = document.getElementsByName("message")[0];
+        var file = document.getElementsByName("file")[0];
+        var handled = false;
+        if (nick.value.length > 0 && file.files.length > 0) {
+            uploadFile(file.files[0], nick.value)
+                .catch((err) => console.error(err));
+            file.value = '';
+            handled = true;
+        }
         if (nick.value.length > 0 && message.value.length > 0) {
             const formData  = new FormData();
             formData.append("nick", nick.value);
@@ -67,6 +156,9 @@ addEventListener("DOMContentLoaded", (event) => {
             fetch("chat", { method: "POST", body: formData })
                 .catch((err) => console.error(err));
             message.value = '';
+            handled = true;
+        }
+        if (handled) {
             e.preventDefault();
             return false;
         }
@@ -0,0 +1,369 @@
+/**
+   @file bwchat_bench.c
+   @brief Microbenchmarks of bwchat-cgi functions
+   @author defanor <defanor@thunix.net>
+   @date 2024
+   @copyright MIT license
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <argp.h>
+
+#include "bwchat.h"
+#include "sha256.h"
+#include "bwchat_cgi.h"
+
+#define UPLOAD_SIZE (1024 * 1024)
+#define BOUNDARY "----bwchatBenchBoundary7MA4YWxk"
+
+/* A benchmark: a function to call repeatedly, once its input is
+   prepared by setup, which returns the input size. */
+struct bench {
+  const char *name;
+  size_t (*setup) (void);
+  void (*run) (void);
+};
+
+/* Allocations are counted by replacing the allocator functions with
+   wrappers around glibc's ones, so that allocations made by the C
+   library itself (e.g., by fdopen(3) or localtime(3)) are counted,
+   too. */
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+extern void __libc_free (void *ptr);
+unsigned long alloc_count = 0;
+
+void *malloc (size_t size) {
+  alloc_count++;
+  return __libc_malloc(size);
+}
+void *calloc (size_t nmemb, size_t size) {
+  alloc_count++;
+  return __libc_calloc(nmemb, size);
+}
+void *realloc (void *ptr, size_t size) {
+  alloc_count++;
+  return __libc_realloc(ptr, size);
+}
+void free (void *ptr) {
+  __libc_free(ptr);
+}
+
+/* Benchmark inputs and outputs */
+char src[BWC_MESSAGE_LENGTH];
+char dst[BWC_MESSAGE_LENGTH];
+char *body = NULL;
+size_t body_len = 0, body_pos = 0;
+struct bwchat_message msg;
+struct form form;
+/* The name an upload is stored under, to remove it in the end */
+char stored_name[STORED_NAME_LENGTH] = "";
+const char *content_type = "multipart/form-data; boundary=" BOUNDARY;
+
+/* Settings */
+long min_time_ms = 200;
+char **filters = NULL;
+int filter_count = 0;
+
+/* An input source reading the prepared body */
+size_t body_read (char *buf, size_t len) {
+  if (len > body_len - body_pos) {
+    len = body_len - body_pos;
+  }
+  memcpy(buf, body + body_pos, len);
+  body_pos += len;
+  return len;
+}
+
+void body_rewind () {
+  body_pos = 0;
+  in_pos = 0;
+  in_len = 0;
+}
+
+/* Prepares a body of the given size, to be filled by the caller. */
+char *body_alloc (size_t len) {
+  free(body);
+  body = malloc(len + 1);
+  if (body == NULL) {
+    perror("malloc()");
+    exit(1);
+  }
+  body_len = len;
+  body_rewind();
+  return body;
+}
+
+/* Fills the source buffer with repetitions of a pattern, up to len
+   bytes; the rest of the buffer is zeroed. */
+size_t src_fill (const char *pattern, size_t len) {
+  size_t i, plen = strlen(pattern);
+  memset(src, 0, sizeof(src));
+  for (i = 0; i < len; i++) {
+    src[i] = pattern[i % plen];
+  }
+  return len;
+}
+
+/* Builds a multipart/form-data body with a nick, and a field of the
+   given name, filename (unless NULL), and contents. */
+void form_body (const char *name, const char *filename,
+                const char *data, size_t len)
+{
+  char head[1024];
+  int head_len = sprintf
+    (head,
+     "--" BOUNDARY "\r\n"
+     "Content-Disposition: form-data; name=\"nick\"\r\n\r\n"
+     "bench\r\n"
+     "--" BOUNDARY "\r\n"
+     "Content-Disposition: form-data; name=\"%s\"%s%s%s\r\n\r\n",
+     name, filename ? "; filename=\"" : "", filename ? filename : "",
+     filename ? "\"" : "");
+  const char *tail = "\r\n--" BOUNDARY "--\r\n";
+  char *b = body_alloc(head_len + len + strlen(tail));
+  memcpy(b, head, head_len);
+  memcpy(b + head_len, data, len);
+  strcpy(b + head_len + len, tail);
+}
+
+/* Fills a buffer with pseudo-random bytes. */
+void noise (char *buf, size_t len) {
+  unsigned long x = 1;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    x = (x * 1103515245UL + 12345UL) & 0x7fffffffUL;
+    buf[i] = x >> 16;
+  }
+}
+
+/* Benchmarks */
+
+size_t setup_escape_short () {
+  return src_fill("hello there, how is it going?", 29);
+}
+size_t setup_escape_entities () {
+  return src_fill("<a href=\"x\">&amp;</a> ", 4096);
+}
+size_t setup_escape_long () {
+  return src_fill("lorem ipsum dolor sit amet ", BWC_MESSAGE_LENGTH - 1);
+}
+void run_escape () {
+  html_escape(dst, src, BWC_MESSAGE_LENGTH);
+}
+
+size_t setup_param () {
+  strcpy(src, "Content-Disposition: form-data; name=\"file\";"
+         " filename=\"holiday photo.jpg\"");
+  return strlen(src);
+}
+void run_param () {
+  read_param(src, "filename", dst, FILENAME_LENGTH);
+}
+
+size_t setup_till_chat () {
+  const char *text = "hello there, how is it going?";
+  char *b = body_alloc(strlen(text) + strlen("\r\n--" BOUNDARY));
+  sprintf(b, "%s\r\n--" BOUNDARY, text);
+  return body_len;
+}
+size_t setup_till_upload () {
+  char *b = body_alloc(UPLOAD_SIZE + strlen("\r\n--" BOUNDARY));
+  noise(b, UPLOAD_SIZE);
+  strcpy(b + UPLOAD_SIZE, "\r\n--" BOUNDARY);
+  return body_len;
+}
+size_t setup_till_pathological () {
+  /* Near-matches of the boundary, each failing at the last byte */
+  const char *near = "\r\n--" BOUNDARY;
+  size_t near_len = strlen(near), i;
+  char *b = body_alloc(64 * 1024 + near_len);
+  for (i = 0; i + near_len <= 64 * 1024; i += near_len) {
+    memcpy(b + i, near, near_len);
+    b[i + near_len - 1] = '?';
+  }
+  memset(b + i, 'x', 64 * 1024 - i);
+  strcpy(b + 64 * 1024, near);
+  return body_len;
+}
+void run_till () {
+  size_t len = 0, matched = 0;
+  body_rewind();
+  while (read_till("\r\n--" BOUNDARY, dst, 4096, &len, &matched) > 0);
+}
+
+size_t setup_print_text () {
+  msg.timestamp = time(NULL);
+  strcpy(msg.nick, "bench");
+  msg.type = BWC_MESSAGE_TEXT;
+  strcpy(msg.data, "hello there, how is it going?");
+  msg.data_len = strlen(msg.data);
+  return msg.data_len;
+}
+size_t setup_print_entities () {
+  setup_print_text();
+  msg.data_len = src_fill("<a href=\"x\">&amp;</a> ", 4096);
+  memcpy(msg.data, src, BWC_MESSAGE_LENGTH);
+  return msg.data_len;
+}
+size_t setup_print_upload () {
+  const char *stored =
+    "2d711642b726b04401627ca9fbac32f5c8530fb1903cc4db02258717921a4881.pdf";
+  setup_print_text();
+  msg.type = BWC_MESSAGE_UPLOAD;
+  strcpy(msg.data, stored);
+  strcpy(msg.data + strlen(stored) + 1, "My Report.pdf");
+  msg.data_len = strlen(stored) + 1 + strlen("My Report.pdf");
+  return msg.data_len;
+}
+void run_print () {
+  print_message(&msg, "%H:%M");
+  /* Discard the output */
+  out_len = 0;
+}
+
+size_t setup_form_chat () {
+  const char *text = "hello there, how is it going?";
+  form_body("message", NULL, text, strlen(text));
+  return body_len;
+}
+size_t setup_form_upload () {
+  char *data = malloc(UPLOAD_SIZE);
+  if (data == NULL) {
+    perror("malloc()");
+    exit(1);
+  }
+  noise(data, UPLOAD_SIZE);
+  form_body("file", "upload", data, UPLOAD_SIZE);
+  free(data);
+  return body_len;
+}
+size_t setup_form_pathological () {
+  const char *near = "\r\n--" BOUNDARY;
+  size_t near_len = strlen(near), i;
+  for (i = 0; i + near_len <= BWC_MESSAGE_LENGTH / 2; i += near_len) {
+    memcpy(src + i, near, near_len);
+    src[i + near_len - 1] = '?';
+  }
+  form_body("message", NULL, src, i);
+  return body_len;
+}
+void run_form () {
+  body_rewind();
+  form_reset(&form);
+  parse_form(content_type, &form);
+  if (form.stored_name[0] != '\0') {
+    strcpy(stored_name, form.stored_name);
+  }
+}
+
+struct bench benches[] = {
+  { "html_escape/short", setup_escape_short, run_escape },
+  { "html_escape/entities", setup_escape_entities, run_escape },
+  { "html_escape/long", setup_escape_long, run_escape },
+  { "read_param/disposition", setup_param, run_param },
+  { "read_till/chat", setup_till_chat, run_till },
+  { "read_till/upload", setup_till_upload, run_till },
+  { "read_till/pathological", setup_till_pathological, run_till },
+  { "print_message/text", setup_print_text, run_print },
+  { "print_message/entities", setup_print_entities, run_print },
+  { "print_message/upload", setup_print_upload, run_print },
+  { "parse_form/chat", setup_form_chat, run_form },
+  { "parse_form/upload", setup_form_upload, run_form },
+  { "parse_form/pathological", setup_form_pathological, run_form },
+  { NULL, NULL, NULL }
+};
+
+static struct argp_option options[] = {
+  {"min-time", 't', "MS", 0,
+   "Minimum time to run each benchmark for (200 by default)", 0 },
+  { 0 }
+};
+static error_t parse_opt (int key, char *arg, struct argp_state *state) {
+  switch (key) {
+  case 't':
+    min_time_ms = strtol(arg, NULL, 10);
+    break;
+  case ARGP_KEY_ARGS:
+    filters = state->argv + state->next;
+    filter_count = state->argc - state->next;
+    break;
+  default:
+    return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+static struct argp argp =
+  { options, parse_opt, "[FILTER...]",
+    "A basic web chat, microbenchmarks of the CGI program. Only the"
+    " benchmarks with names containing one of the FILTERs are run, if any"
+    " are given.", 0, 0, 0 };
+
+double now_ns () {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int selected (const char *name) {
+  int i;
+  for (i = 0; i < filter_count; i++) {
+    if (strstr(name, filters[i]) != NULL) {
+      return 1;
+    }
+  }
+  return filter_count == 0;
+}
+
+int main (int argc, char **argv) {
+  char dir[] = "/tmp/bwchat-bench-XXXXXX";
+  struct bench *b;
+  size_t bytes;
+  unsigned long n, i, allocs;
+  double elapsed, start;
+
+  argp_parse(&argp, argc, argv, 0, 0, 0);
+  /* Uploads are stored in the working directory. */
+  if (mkdtemp(dir) == NULL || chdir(dir) != 0) {
+    perror("Failed to create a temporary directory");
+    return 1;
+  }
+  in_read = body_read;
+  printf("benchmark\titerations\tns_per_call\tbytes_per_call"
+         "\tns_per_byte\tallocs_per_call\n");
+  for (b = benches; b->name != NULL; b++) {
+    if (! selected(b->name)) {
+      continue;
+    }
+    bytes = b->setup();
+    /* Warm up, e.g. for localtime(3) to load the time zone. */
+    b->run();
+    n = 1;
+    do {
+      n *= 2;
+      allocs = alloc_count;
+      start = now_ns();
+      for (i = 0; i < n; i++) {
+        b->run();
+      }
+      elapsed = now_ns() - start;
+      allocs = alloc_count - allocs;
+    } while (elapsed < min_time_ms * 1e6);
+    printf("%s\t%lu\t%.1f\t%lu\t%.3f\t%.2f\n", b->name, n, elapsed / n,
+           (unsigned long)bytes, bytes ? elapsed / n / bytes : 0,
+           (double)allocs / n);
+    fflush(stdout);
+  }
+  if (stored_name[0] != '\0') {
+    unlink(stored_name);
+  }
+  if (chdir("/") != 0 || rmdir(dir) != 0) {
+    perror("Failed to remove the temporary directory");
+  }
+  return 0;
+}
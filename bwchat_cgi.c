@@ -10,7 +10,9 @@
 #include <string.h>
 #include <stdio.h>
 #include <libgen.h>
+#include <ctype.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 #include <syslog.h>
@@ -18,20 +20,46 @@
 #include <sys/un.h>
 #include <errno.h>
 #include <sys/select.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <sched.h>
+#include <stdarg.h>
 #include <argp.h>
 
 #include "bwchat.h"
+#include "sha256.h"
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
+#if defined(HAVE_FCGI) && defined(BWC_BENCH)
+/* Benchmarks run with plain stdio. */
+#undef HAVE_FCGI
+#endif
+#include "probes.h"
 #ifdef HAVE_FCGI
 #include "fcgi_stdio.h"
 #endif
 
-#define BOUNDARY_LENGTH 128
+#include "bwchat_cgi.h"
+
 #define FIELD_NAME_LENGTH 128
-#define FILENAME_LENGTH 128
+#define SEARCH_QUERY_LENGTH 256
+#define TIME_FORMAT "%H:%M"
+/* Attempts to read the shared history before falling back to asking
+   the server */
+#define HISTORY_READ_ATTEMPTS 10000
+#define SEARCH_TIME_FORMAT "%Y-%m-%d %H:%M"
+#define UPLOAD_ID_LENGTH 32
+#define UPLOAD_NAME_LENGTH 1024
+
+/* A byte range received in a resumable upload */
+struct upload_range {
+  unsigned long offset, length;
+};
 
 enum form_data_parsing_state {
   FORM_PARSE_START,
@@ -52,39 +80,122 @@ enum param_read_state {
 
 /* Global state */
 int sock = -1;
+/* Buffered input, and its source */
+char in_buf[IN_BUF_SIZE];
+size_t in_pos = 0, in_len = 0;
+size_t (*in_read) (char *buf, size_t len) = stdin_read;
+/* The shared message history mapping, kept between FastCGI requests */
+int history_fd = -1;
+const struct bwchat_history *history = NULL;
+struct bwchat_message history_copy[BWC_MESSAGE_COUNT];
+/* Pending output, and the last time it was flushed */
+char out_buf[OUT_BUF_SIZE];
+size_t out_len = 0;
+struct timeval out_last_flush;
 
 /* Settings */
 const char *upload_dir_url = "upload/";
+const char *partial_dir = ".partial";
+long partial_expiry = 7 * 24 * 60 * 60;
 const char *js_url = "bwchat.js";
 const char *sock_path = "bwchat-socket";
+const char *shm_name = "/bwchat-history";
+int room_player = 0;
+long coalesce_ms = 10;
+size_t coalesce_bytes = 16 * 1024;
 int log_stderr = 0;
 
+/* Reads the request body. */
+size_t stdin_read (char *buf, size_t len) {
+  ssize_t ret;
+#ifdef HAVE_FCGI
+  ret = fread(buf, 1, len, stdin);
+#else
+  ret = read(STDIN_FILENO, buf, len);
+#endif
+  return ret < 0 ? 0 : ret;
+}
+
+/* Returns the next input byte, or -1 at the end of input. */
+int in_getc () {
+  if (in_pos == in_len) {
+    in_len = in_read(in_buf, IN_BUF_SIZE);
+    in_pos = 0;
+    if (in_len == 0) {
+      return -1;
+    }
+  }
+  return (unsigned char)in_buf[in_pos++];
+}
+
+/* Escapes a string for HTML, reading it up to its terminating zero
+   byte or sz - 1 bytes, and truncating the result to fit into sz
+   bytes of dst. */
 char *html_escape (char *dst, const char *src, size_t sz) {
-  size_t i, j;
-  for (i = 0, j = 0; (i < (sz - 1)) && (j < (sz - 1)); i++, j++) {
+  size_t i, j, len;
+  const char *entity;
+  for (i = 0, j = 0; (i < (sz - 1)) && (j < (sz - 1)) && src[i] != '\0';
+       i++) {
     if (src[i] == '<') {
-      strncpy(dst + j, "&lt;", sz - j);
-      j += 3;
+      entity = "&lt;";
     } else if (src[i] == '>') {
-      strncpy(dst + j, "&gt;", sz - j);
-      j += 3;
+      entity = "&gt;";
     } else if (src[i] == '"') {
-      strncpy(dst + j, "&quot;", sz - j);
-      j += 5;
+      entity = "&quot;";
     } else if (src[i] == '&') {
-      strncpy(dst + j, "&amp;", sz - j);
-      j += 4;
+      entity = "&amp;";
     } else {
-      dst[j] = src[i];
+      dst[j++] = src[i];
+      continue;
     }
-  }
-  if (j > sz - 1) {
-    j = sz - 1;
+    len = strlen(entity);
+    if (len > sz - 1 - j) {
+      len = sz - 1 - j;
+    }
+    memcpy(dst + j, entity, len);
+    j += len;
   }
   dst[j] = '\0';
   return dst;
 }
 
+/*
+  https://www.rfc-editor.org/rfc/rfc3986#section-2.1 -- Percent-Encoding
+  https://url.spec.whatwg.org/#urlencoded-parsing
+*/
+/* Finds a parameter in a URL query, and decodes its value into dst. */
+char *query_param (const char *query, const char *name, char *dst, size_t sz)
+{
+  size_t name_len = strlen(name), j = 0;
+  unsigned int c;
+  dst[0] = '\0';
+  while (query != NULL && *query != '\0') {
+    if (strncmp(query, name, name_len) == 0 && query[name_len] == '=') {
+      query += name_len + 1;
+      while (*query != '\0' && *query != '&' && j < sz - 1) {
+        if (*query == '+') {
+          dst[j++] = ' ';
+        } else if (*query == '%' && isxdigit((unsigned char)query[1]) &&
+                   isxdigit((unsigned char)query[2]) &&
+                   sscanf(query + 1, "%2x", &c) == 1) {
+          dst[j++] = c;
+          query += 2;
+        } else {
+          dst[j++] = *query;
+        }
+        query++;
+      }
+      dst[j] = '\0';
+      return dst;
+    }
+    query = strchr(query, '&');
+    if (query != NULL) {
+      query++;
+    }
+  }
+  return dst;
+}
+
 /*
   https://www.rfc-editor.org/rfc/rfc822 -- Internet text messages
   https://www.rfc-editor.org/rfc/rfc2183 -- Content-Disposition
@@ -168,9 +279,11 @@ int read_till (const char *end,
     *out_data_len = 0;
   }
 
+  PROBE1(read__till__start, *matched);
   while (*out_data_len + *matched < out_buf_len) {
-    int c = getchar();
+    int c = in_getc();
     if (c == -1) {
+      PROBE2(read__till__done, *out_data_len, -1);
       return -1;
     }
     out[*out_data_len + *matched] = c;
@@ -190,74 +303,367 @@ int read_till (const char *end,
     /* Found the match */
     if (end_len == *matched) {
       out[*out_data_len] = '\0';
+      PROBE2(read__till__done, *out_data_len, 0);
       return 0;
     }
   }
   /* Not found yet: the caller should consume the read bytes and keep
      iterating. */
+  PROBE2(read__till__done, *out_data_len, 1);
   return 1;
 }
 
 
+/* Moves a freshly written temporary file into the content-addressed
+   store, under its SHA-256 digest: such names never change their
+   contents, so the files can be cached indefinitely, and a repeated
+   upload just reuses the existing file. An extension of the original
+   name is kept in an additional hard link, so that a web server can
+   pick a content type. The resulting name is written into
+   stored_name. */
+int store_upload (const char *tmp_name, struct sha256_ctx *sha,
+                  const char *filename, char *stored_name, size_t sz)
+{
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  char digest_hex[SHA256_DIGEST_LENGTH * 2 + 1];
+  const char *ext = strrchr(filename, '.');
+  size_t i, ext_len = 0;
+
+  sha256_final(sha, digest);
+  sha256_hex(digest, digest_hex);
+  if (link(tmp_name, digest_hex) != 0 && errno != EEXIST) {
+    syslog(LOG_ERR, "Failed to store a file: %s", strerror(errno));
+    return -1;
+  }
+  unlink(tmp_name);
+
+  if (ext != NULL) {
+    ext++;
+    ext_len = strlen(ext);
+    for (i = 0; i < ext_len; i++) {
+      if (! isalnum((unsigned char)ext[i])) {
+        ext_len = 0;
+      }
+    }
+  }
+  if (ext_len > 0 && ext_len < EXTENSION_LENGTH &&
+      SHA256_DIGEST_LENGTH * 2 + 1 + ext_len < sz) {
+    sprintf(stored_name, "%s.%s", digest_hex, ext);
+    if (link(digest_hex, stored_name) != 0 && errno != EEXIST) {
+      syslog(LOG_ERR, "Failed to link a stored file: %s", strerror(errno));
+      strcpy(stored_name, digest_hex);
+    }
+  } else {
+    strcpy(stored_name, digest_hex);
+  }
+  return 0;
+}
+
+/* Connects to the chat server, which is only done when needed. */
 int sock_conn() {
   struct sockaddr_un addr;
   socklen_t addr_size;
   sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
-  if (sock < 0) {
+  if (sock >= 0) {
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path) - 1);
+    addr_size = sizeof(struct sockaddr_un);
+    if (connect(sock, (struct sockaddr *) &addr, addr_size) == 0) {
+      return sock;
+    }
+    close(sock);
+    sock = -1;
+  }
+  syslog(LOG_DEBUG,
+         "Failed to connect to the chat server at %s: %s",
+         sock_path, strerror(errno));
+  return -1;
+}
+
+/* Writes out pending output, followed by len bytes of data (which
+   may be NULL), without copying the latter. Pending output is
+   discarded on failure. */
+int out_flush_with (const char *data, size_t len) {
+  struct iovec iov[2];
+  int cnt = 0, ret = 0;
+  if (out_len > 0) {
+    iov[cnt].iov_base = out_buf;
+    iov[cnt].iov_len = out_len;
+    cnt++;
+  }
+  if (len > 0) {
+    iov[cnt].iov_base = (void *)data;
+    iov[cnt].iov_len = len;
+    cnt++;
+  }
+#ifdef HAVE_FCGI
+  /* Buffered by libfcgi, and sent as a single record (unless it is
+     too large for one) on fflush. */
+  {
+    int i;
+    for (i = 0; i < cnt && ret == 0; i++) {
+      if (fwrite(iov[i].iov_base, 1, iov[i].iov_len, stdout) <
+          iov[i].iov_len) {
+        ret = -1;
+      }
+    }
+    if (fflush(stdout) < 0) {
+      ret = -1;
+    }
+  }
+#else
+  while (cnt > 0) {
+    ssize_t written = writev(STDOUT_FILENO, iov, cnt);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      ret = -1;
+      break;
+    }
+    /* Skip what is written, in case if it is a partial write */
+    while (cnt > 0 && (size_t)written >= iov[0].iov_len) {
+      written -= iov[0].iov_len;
+      iov[0] = iov[1];
+      cnt--;
+    }
+    if (cnt > 0) {
+      iov[0].iov_base = (char *)iov[0].iov_base + written;
+      iov[0].iov_len -= written;
+    }
+  }
+#endif
+  out_len = 0;
+  gettimeofday(&out_last_flush, NULL);
+  return ret;
+}
+
+int out_flush () {
+  return out_flush_with(NULL, 0);
+}
+
+/* Queues output, writing it out at once if it does not fit. */
+int out_write (const char *data, size_t len) {
+  if (out_len + len <= OUT_BUF_SIZE) {
+    memcpy(out_buf + out_len, data, len);
+    out_len += len;
+    return 0;
+  }
+  return out_flush_with(data, len);
+}
+
+int out_puts (const char *str) {
+  return out_write(str, strlen(str));
+}
+
+int out_printf (const char *format, ...) {
+  va_list ap;
+  int len;
+  char *tmp;
+  va_start(ap, format);
+  len = vsnprintf(out_buf + out_len, OUT_BUF_SIZE - out_len, format, ap);
+  va_end(ap);
+  if (len < 0) {
     return -1;
   }
-  addr.sun_family = AF_UNIX;
-  strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path) - 1);
-  addr_size = sizeof(struct sockaddr_un);
-  if (connect(sock, (struct sockaddr *) &addr, addr_size) < 0) {
+  if ((size_t)len < OUT_BUF_SIZE - out_len) {
+    out_len += len;
+    return len;
+  }
+  /* Does not fit into the buffer's remaining space. */
+  tmp = malloc(len + 1);
+  if (tmp == NULL) {
     return -1;
   }
-  return sock;
+  va_start(ap, format);
+  vsnprintf(tmp, len + 1, format, ap);
+  va_end(ap);
+  if (out_write(tmp, len) < 0) {
+    len = -1;
+  }
+  free(tmp);
+  return len;
+}
+
+/* Flushes pending output if enough of it has accumulated, or if the
+   coalescing window since the last flush is over. Otherwise sets
+   wait_ms to the time left until the window is over, or to -1 if
+   there is nothing to wait for. This way a single message goes out at
+   once, while a burst of them gets combined into fewer writes (and
+   FastCGI records). */
+int out_coalesce (long *wait_ms) {
+  struct timeval now;
+  long elapsed;
+  *wait_ms = -1;
+  if (out_len == 0) {
+    return 0;
+  }
+  gettimeofday(&now, NULL);
+  elapsed = (now.tv_sec - out_last_flush.tv_sec) * 1000 +
+    (now.tv_usec - out_last_flush.tv_usec) / 1000;
+  if (out_len >= coalesce_bytes || elapsed >= coalesce_ms || elapsed < 0) {
+    return out_flush();
+  }
+  *wait_ms = coalesce_ms - elapsed;
+  return 0;
 }
 
-int print_message (struct bwchat_message *msg) {
+int print_message (struct bwchat_message *msg, const char *time_format) {
   char nick[BWC_NICK_LENGTH];
   char message[BWC_MESSAGE_LENGTH];
   struct tm *btime;
+  int ret = 0;
 
   if (msg->type == BWC_MESSAGE_NONE) {
     return 0;
   }
+  PROBE2(print__message__start, msg->type, msg->data_len);
   btime = localtime(&(msg->timestamp));
-  strftime(message, BWC_MESSAGE_LENGTH, "%H:%M", btime);
+  strftime(message, BWC_MESSAGE_LENGTH, time_format, btime);
   html_escape(nick, msg->nick, BWC_NICK_LENGTH);
-  if (printf("      <div>%s <b>%s</b>: ", message, nick) < 0) {
-    return -1;
-  }
-  if (msg->type == BWC_MESSAGE_TEXT) {
+  if (out_printf("      <div>%s <b>%s</b>: ", message, nick) < 0) {
+    ret = -1;
+  } else if (msg->type == BWC_MESSAGE_TEXT) {
     html_escape(message, msg->data, BWC_MESSAGE_LENGTH);
-    if (printf("%s", message) < 0) {
-      return -1;
-    }
+    ret = out_puts(message);
   } else if (msg->type == BWC_MESSAGE_UPLOAD) {
-    html_escape(message, msg->data, BWC_MESSAGE_LENGTH);
-    if (printf("<a href=\"%s%s\">%s</a>", upload_dir_url,
-               message, message) < 0) {
-      return -1;
+    /* The stored file name, optionally followed by a name to
+       display. */
+    char stored_name[FILENAME_LENGTH * 6];
+    const char *display_name = msg->data;
+    size_t stored_len = strlen(msg->data);
+    if (stored_len + 1 < msg->data_len &&
+        msg->data_len < BWC_MESSAGE_LENGTH) {
+      display_name = msg->data + stored_len + 1;
     }
+    html_escape(stored_name, msg->data, sizeof(stored_name));
+    html_escape(message, display_name,
+                BWC_MESSAGE_LENGTH - (display_name - msg->data));
+    ret = out_printf("<a href=\"%s%s\" download=\"%s\">%s</a>",
+                     upload_dir_url, stored_name, message, message);
   } else if (msg->type == BWC_MESSAGE_AUDIO) {
-    if (printf
-        ("<audio controls=\"\" preload=\"none\" src=\"stream?%s\"></audio>",
-         nick) < 0) {
-      return -1;
+    ret = out_printf
+      ("<audio controls=\"\" preload=\"none\" src=\"stream?%s\"></audio>",
+       nick);
+  } else if (msg->type == BWC_MESSAGE_AUDIO_ENDED) {
+    ret = out_puts("<i>(audio stream ended)</i>");
+  }
+  if (ret >= 0) {
+    ret = out_puts("</div>\n");
+  }
+  ret = ret < 0 ? -1 : 0;
+  PROBE2(print__message__done, out_len, ret);
+  return ret;
+}
+
+/* Maps the message history published by bwchat-server, or checks
+   that an existing mapping is still current. */
+int history_map () {
+  struct stat st;
+  void *h;
+  if (history != NULL) {
+    if (fstat(history_fd, &st) == 0 && st.st_nlink > 0) {
+      return 0;
     }
+    /* The server has unlinked it, and possibly published a new one. */
+    munmap((void *)history, sizeof(struct bwchat_history));
+    close(history_fd);
+    history = NULL;
+    history_fd = -1;
+  }
+  history_fd = shm_open(shm_name, O_RDONLY, 0);
+  if (history_fd < 0) {
+    return -1;
+  }
+  if (fstat(history_fd, &st) < 0 ||
+      st.st_size < (off_t)sizeof(struct bwchat_history)) {
+    close(history_fd);
+    history_fd = -1;
+    return -1;
   }
-  if (puts("</div>") < 0) {
+  h = mmap(NULL, sizeof(struct bwchat_history), PROT_READ, MAP_SHARED,
+           history_fd, 0);
+  if (h == MAP_FAILED) {
+    syslog(LOG_ERR, "mmap() failure: %s", strerror(errno));
+    close(history_fd);
+    history_fd = -1;
     return -1;
   }
+  history = h;
   return 0;
 }
 
+/* Takes a consistent snapshot of the shared history into
+   history_copy, in chronological order, returns the number of
+   messages, or -1 if it fails within HISTORY_READ_ATTEMPTS (as it
+   would if the server died amid an update). */
+int history_read () {
+  unsigned long seq;
+  unsigned int i, oldest;
+  int n = 0, attempts;
+  PROBE(history__read__start);
+  for (attempts = 1; attempts <= HISTORY_READ_ATTEMPTS; attempts++) {
+    seq = history->seq;
+    if (seq & 1) {
+      /* Being updated: let the server proceed. */
+      sched_yield();
+      continue;
+    }
+    __sync_synchronize();
+    oldest = history->oldest;
+    for (i = 0, n = 0; i < BWC_MESSAGE_COUNT; i++) {
+      const struct bwchat_message *src =
+        &(history->messages[(oldest + i) % BWC_MESSAGE_COUNT]);
+      struct bwchat_message *dst = &(history_copy[n]);
+      if (src->type == BWC_MESSAGE_NONE) {
+        continue;
+      }
+      /* Only the used part is copied; the length may be garbage if
+         the history is being updated concurrently. */
+      dst->timestamp = src->timestamp;
+      memcpy(dst->nick, src->nick, BWC_NICK_LENGTH);
+      dst->nick[BWC_NICK_LENGTH - 1] = '\0';
+      dst->type = src->type;
+      dst->data_len = src->data_len;
+      if (dst->data_len >= BWC_MESSAGE_LENGTH) {
+        dst->data_len = BWC_MESSAGE_LENGTH - 1;
+      }
+      memcpy(dst->data, src->data, dst->data_len);
+      dst->data[dst->data_len] = '\0';
+      n++;
+    }
+    __sync_synchronize();
+    if (history->seq == seq) {
+      PROBE2(history__read__done, n, attempts);
+      return n;
+    }
+  }
+  syslog(LOG_WARNING, "Failed to read the shared history");
+  PROBE2(history__read__done, -1, attempts);
+  return -1;
+}
+
 int print_messages () {
   struct bwchat_message msg;
   ssize_t len;
   char c = BWC_CMD_ALL_MESSAGES;
-  if (printf("    <div id=\"messages\">\n") < 0) {
+  int i, n;
+  if (out_puts("    <div id=\"messages\">\n") < 0) {
+    return -1;
+  }
+  if (history_map() == 0 && (n = history_read()) >= 0) {
+    /* Reading the shared history, without bothering the server. */
+    for (i = 0; i < n; i++) {
+      if (print_message(&(history_copy[i]), TIME_FORMAT) != 0) {
+        return -1;
+      }
+    }
+    if (out_puts("    </div>\n") < 0) {
+      return -1;
+    }
+    return 0;
+  }
+  if (sock_conn() < 0) {
     return -1;
   }
   write(sock, &c, 1);
@@ -269,11 +675,11 @@ int print_messages () {
     if (len < (ssize_t)sizeof(msg)) {
       return -1;
     }
-    if (print_message(&msg) != 0) {
+    if (print_message(&msg, TIME_FORMAT) != 0) {
       return -1;
     }
   }
-  if (printf("    </div>\n") < 0) {
+  if (out_puts("    </div>\n") < 0) {
     return -1;
   }
   return 0;
@@ -284,37 +690,48 @@ int serve_messages () {
   fd_set rset;
   struct timeval timeout;
   struct bwchat_message msg;
-  char c = BWC_CMD_NEW_MESSAGES;
+  char c = BWC_CMD_NEW_MESSAGES_HEARTBEAT;
   int ret;
-  if (printf("Content-type: text/html\r\n"
-             "Cache-Control: no-cache\r\n"
-             "X-Accel-Buffering: no\r\n"
-             "\r\n") < 0) {
+  long wait_ms;
+  ssize_t len;
+  if (sock_conn() < 0) {
+    return -1;
+  }
+  if (out_puts("Content-type: text/html\r\n"
+               "Cache-Control: no-cache\r\n"
+               "X-Accel-Buffering: no\r\n"
+               "\r\n") < 0 ||
+      out_flush() < 0) {
     return -1;
   }
   write(sock, &c, 1);
 
   while (1) {
-    timeout.tv_sec = 10;
-    timeout.tv_usec = 0;
+    if (out_coalesce(&wait_ms) < 0) {
+      break;
+    }
+    timeout.tv_sec = wait_ms / 1000;
+    timeout.tv_usec = (wait_ms % 1000) * 1000;
     FD_ZERO(&rset);
     FD_SET(sock, &rset);
-    ret = select(sock + 1, &rset, NULL, NULL, &timeout);
-    if (ret == 0) {
-      /* Timeout, send a ping. Primarily to see if the client is still
-         there, though it would also let the client know that the
-         connection is live, and possibly help to avoid gateway
-         timeouts. */
-      if (puts("") < 0) {
-        break;
-      }
-    } else if (ret == 1) {
+    ret = select(sock + 1, &rset, NULL, NULL,
+                 wait_ms >= 0 ? &timeout : NULL);
+    if (ret == 1) {
       /* Input available */
-      if (read(sock, &msg, sizeof(msg)) != sizeof(msg)) {
+      len = read(sock, &msg, sizeof(msg));
+      if (len >= (ssize_t)BWC_HEARTBEAT_LENGTH &&
+          msg.type == BWC_MESSAGE_NONE) {
+        /* A heartbeat from the server, pass it on as a ping.
+           Primarily to see if the client is still there, though it
+           would also let the client know that the connection is live,
+           and possibly help to avoid gateway timeouts. */
+        if (out_puts("\n") < 0 || out_flush() < 0) {
+          break;
+        }
+      } else if (len != sizeof(msg)) {
         syslog(LOG_WARNING, "serve_messages: bwchat-server is gone");
         return 0;
-      }
-      if (print_message(&msg) != 0) {
+      } else if (print_message(&msg, TIME_FORMAT) != 0) {
         break;
       }
     } else if (ret == -1) {
@@ -322,51 +739,65 @@ int serve_messages () {
       syslog(LOG_ERR, "select() error in serve_messages");
       break;
     }
-    if (fflush(stdout) < 0) {
-      break;
-    }
   }
   syslog(LOG_DEBUG, "a message listener is gone");
   return 0;
 }
 
-int serve_stream () {
+/* Passes an audio stream on to the client: the one of the nick in the
+   query string, or the room mix. */
+int serve_stream (int room) {
   fd_set rset;
   struct timeval timeout;
   char *query_string = getenv("QUERY_STRING");
   char buf[BWC_MESSAGE_LENGTH];
-  size_t len;
+  ssize_t len;
   int ret;
-  buf[0] = BWC_CMD_AUDIO_STREAM;
-  strncpy(buf + 1, query_string, BWC_NICK_LENGTH);
-  write(sock, buf, BWC_NICK_LENGTH + 1);
+  long wait_ms;
+  if (sock_conn() < 0) {
+    return -1;
+  }
+  if (room) {
+    buf[0] = BWC_CMD_ROOM_STREAM;
+    write(sock, buf, 1);
+  } else {
+    buf[0] = BWC_CMD_AUDIO_STREAM;
+    strncpy(buf + 1, query_string, BWC_NICK_LENGTH);
+    write(sock, buf, BWC_NICK_LENGTH + 1);
+  }
 
   /* Send HTTP headers */
-  printf("Content-type: audio/ogg\r\n"
-         "Cache-Control: no-cache\r\n"
-         "X-Accel-Buffering: no\r\n"
-         "\r\n");
+  if (out_puts("Content-type: audio/ogg\r\n"
+               "Cache-Control: no-cache\r\n"
+               "X-Accel-Buffering: no\r\n"
+               "\r\n") < 0) {
+    return -1;
+  }
 
-  /* Wait for new stream chunks, pass them to the client */
+  /* Wait for new stream chunks, pass them to the client. The server
+     closes the connection once the stream ends. */
   while (1) {
-    timeout.tv_sec = 10;
-    timeout.tv_usec = 0;
+    if (out_coalesce(&wait_ms) < 0) {
+      break;
+    }
+    timeout.tv_sec = wait_ms / 1000;
+    timeout.tv_usec = (wait_ms % 1000) * 1000;
     FD_ZERO(&rset);
     FD_SET(sock, &rset);
-    ret = select(sock + 1, &rset, NULL, NULL, &timeout);
-    if (ret != 1) {
-      /* Timeout or error: break. */
+    ret = select(sock + 1, &rset, NULL, NULL,
+                 wait_ms >= 0 ? &timeout : NULL);
+    if (ret == 0) {
+      /* The coalescing window is over, flush on the next iteration. */
+      continue;
+    } else if (ret != 1) {
       break;
     }
     len = read(sock, &buf, sizeof(buf));
     if (len <= 0) {
-      syslog(LOG_WARNING, "serve_stream: bwchat-server is gone");
-      return 0;
-    }
-    if (fwrite(buf, 1, len, stdout) < len) {
+      syslog(LOG_DEBUG, "serve_stream: the stream is over");
       break;
     }
-    if (fflush(stdout) < 0) {
+    if (out_write(buf, len) < 0) {
       break;
     }
   }
@@ -374,167 +805,274 @@ int serve_stream () {
   return 0;
 }
 
-int handle_chat () {
-  size_t message_len = 0, matched = 0, len = 0;
+/* Renders a search form, and archived messages matching the query. */
+int serve_search () {
+  struct bwchat_message msg;
+  char query[SEARCH_QUERY_LENGTH], escaped[SEARCH_QUERY_LENGTH * 6];
+  char cmd[1 + SEARCH_QUERY_LENGTH];
+  ssize_t len;
+  query_param(getenv("QUERY_STRING"), "q", query, SEARCH_QUERY_LENGTH);
+  html_escape(escaped, query, sizeof(escaped));
+  out_printf
+    ("Content-type: text/html\r\n"
+     "\r\n"
+     "<!DOCTYPE html>\n"
+     "<html>\n"
+     "  <head>\n"
+     "    <title>Chat search</title>\n"
+     "  </head>\n"
+     "  <body>\n"
+     "    <form method=\"get\">\n"
+     "      <input type=\"search\" name=\"q\" value=\"%s\" autofocus=\"\""
+     " size=\"60\" />\n"
+     "      <input type=\"submit\" value=\"Search\" />\n"
+     "    </form>\n"
+     "    <div id=\"results\">\n",
+     escaped);
+  if (query[0] != '\0' && sock_conn() >= 0) {
+    cmd[0] = BWC_CMD_SEARCH;
+    strcpy(cmd + 1, query);
+    if (write(sock, cmd, 1 + strlen(query)) < 0) {
+      syslog(LOG_ERR, "Failed to send a query: %s", strerror(errno));
+    } else {
+      while ((len = read(sock, &msg, sizeof(msg))) == sizeof(msg)) {
+        if (print_message(&msg, SEARCH_TIME_FORMAT) != 0) {
+          return -1;
+        }
+      }
+    }
+  }
+  return out_puts("    </div>\n"
+                  "  </body>\n"
+                  "</html>\n");
+}
+
+/* Clears parsed form data. */
+void form_reset (struct form *form) {
+  form->message[0] = '\0';
+  form->message_len = 0;
+  form->nick[0] = '\0';
+  form->filename[0] = '\0';
+  form->stored_name[0] = '\0';
+  form->stream = 0;
+}
+
+/* Parses multipart/form-data (nick, message, file, stream) from the
+   input into a reset form, storing uploaded files. Returns 0 on
+   success. */
+int parse_form (const char *content_type, struct form *form) {
+  size_t matched = 0, len = 0;
   enum form_data_parsing_state ps = FORM_PARSE_START;
   char
-    *request_method = getenv("REQUEST_METHOD"),
-    *content_type = getenv("CONTENT_TYPE"),
-    message[BWC_MESSAGE_LENGTH + BOUNDARY_LENGTH + 4] = "\0",
-    nick[BWC_NICK_LENGTH + BOUNDARY_LENGTH + 4] = "\0",
-    filename[FILENAME_LENGTH] = "\0",
     boundary[BOUNDARY_LENGTH + 4],
     field_name[FIELD_NAME_LENGTH],
     buf[4096];
-  int stream = 0;
 
-  if (strcmp(request_method, "POST") == 0) {
-    if (content_type != NULL &&
-        strncmp(content_type, "multipart/form-data;", 20) == 0) {
-      /* Parse form data: nick, message, file, stream */
-      strcpy(boundary, "\r\n--");
-      read_param(content_type, "boundary",
-                 boundary + 4, BOUNDARY_LENGTH - 2);
-      if (read_till(boundary + 2, buf, 4096, &len, &matched) != 0) {
-        syslog(LOG_ERR, "No initial boundary found");
+  strcpy(boundary, "\r\n--");
+  read_param(content_type, "boundary",
+             boundary + 4, BOUNDARY_LENGTH - 2);
+  if (read_till(boundary + 2, buf, 4096, &len, &matched) != 0) {
+    syslog(LOG_ERR, "No initial boundary found");
+    ps = FORM_PARSE_FAIL;
+  }
+  while (ps != FORM_PARSE_FAIL && ps != FORM_PARSE_DONE) {
+    len = 0;
+    matched = 0;
+    if (ps == FORM_PARSE_START) {
+      if (read_till("\r\n", buf, 4096, &len, &matched) == 0) {
+        if (len == 0) {
+          ps = FORM_PARSE_HEADER;
+        } else if (len == 2 && strcmp(buf, "--") == 0) {
+          ps = FORM_PARSE_DONE;
+        }
+      } else {
+        syslog(LOG_ERR, "Failed to start parsing");
         ps = FORM_PARSE_FAIL;
       }
-      while (ps != FORM_PARSE_FAIL && ps != FORM_PARSE_DONE) {
-        len = 0;
-        matched = 0;
-        if (ps == FORM_PARSE_START) {
-          if (read_till("\r\n", buf, 4096, &len, &matched) == 0) {
-            if (len == 0) {
-              ps = FORM_PARSE_HEADER;
-            } else if (len == 2 && strcmp(buf, "--") == 0) {
-              ps = FORM_PARSE_DONE;
-            }
-          } else {
-            syslog(LOG_ERR, "Failed to start parsing");
-            ps = FORM_PARSE_FAIL;
-          }
-        } else if (ps == FORM_PARSE_HEADER) {
-          if (read_till("\r\n", buf, 4096, &len, &matched) == 0) {
-            if (strncmp(buf, "Content-Disposition: form-data;", 31) == 0) {
-              read_param(buf, "name", field_name, FIELD_NAME_LENGTH);
-              read_param(buf, "filename", filename, FILENAME_LENGTH);
-            } else if (len == 0) {
-              ps = FORM_PARSE_DATA;
-            }
-          } else {
-            syslog(LOG_ERR, "Failed to parse a header");
-            ps = FORM_PARSE_FAIL;
+    } else if (ps == FORM_PARSE_HEADER) {
+      if (read_till("\r\n", buf, 4096, &len, &matched) == 0) {
+        if (strncmp(buf, "Content-Disposition: form-data;", 31) == 0) {
+          read_param(buf, "name", field_name, FIELD_NAME_LENGTH);
+          read_param(buf, "filename", form->filename, FILENAME_LENGTH);
+        } else if (len == 0) {
+          ps = FORM_PARSE_DATA;
+        }
+      } else {
+        syslog(LOG_ERR, "Failed to parse a header");
+        ps = FORM_PARSE_FAIL;
+      }
+    } else if (ps == FORM_PARSE_DATA) {
+      if (strcmp(field_name, "nick") == 0) {
+        if (read_till(boundary, form->nick,
+                      BWC_NICK_LENGTH + BOUNDARY_LENGTH + 4,
+                      &len, &matched) == 0) {
+          ps = FORM_PARSE_START;
+        } else {
+          syslog(LOG_ERR, "No boundary after nick");
+          ps = FORM_PARSE_FAIL;
+        }
+      } else if (strcmp(field_name, "message") == 0) {
+        if (read_till(boundary, form->message,
+                      BWC_MESSAGE_LENGTH + BOUNDARY_LENGTH + 4,
+                      &(form->message_len), &matched) == 0) {
+          ps = FORM_PARSE_START;
+        } else {
+          syslog(LOG_ERR, "No boundary after message");
+          ps = FORM_PARSE_FAIL;
+        }
+      } else if (strcmp(field_name, "file") == 0 &&
+                 form->filename[0] != '\0') {
+        char tmp_name[] = "upload-XXXXXX";
+        int fd = mkstemp(tmp_name), r = -1;
+        FILE *f = NULL;
+        struct sha256_ctx sha;
+        mode_t mask = umask(0);
+        umask(mask);
+        /* mkstemp(3) creates files readable only by the owner,
+           while fopen(3) would respect the umask. */
+        if (fd < 0 || fchmod(fd, 0666 & ~mask) != 0 ||
+            (f = fdopen(fd, "w")) == NULL) {
+          syslog(LOG_ERR, "Failed to open a file: %s", strerror(errno));
+          if (fd >= 0) {
+            close(fd);
+            unlink(tmp_name);
           }
-        } else if (ps == FORM_PARSE_DATA) {
-          if (strcmp(field_name, "nick") == 0) {
-            if (read_till(boundary, nick,
-                          BWC_NICK_LENGTH + BOUNDARY_LENGTH + 4,
-                          &len, &matched) == 0) {
-              ps = FORM_PARSE_START;
-            } else {
-              syslog(LOG_ERR, "No boundary after nick");
-              ps = FORM_PARSE_FAIL;
-            }
-          } else if (strcmp(field_name, "message") == 0) {
-            if (read_till(boundary, message,
-                          BWC_MESSAGE_LENGTH + BOUNDARY_LENGTH + 4,
-                          &message_len, &matched) == 0) {
-              ps = FORM_PARSE_START;
-            } else {
-              syslog(LOG_ERR, "No boundary after message");
-              ps = FORM_PARSE_FAIL;
-            }
-          } else if (strcmp(field_name, "file") == 0 &&
-                     filename[0] != '\0') {
-            FILE *f = fopen(basename(filename), "w");
-            if (f == NULL) {
-              syslog(LOG_ERR, "Failed to open a file: %s", strerror(errno));
-            } else {
-              int r;
-              do {
-                r = read_till(boundary, buf, 4096, &len, &matched);
-                if (r >= 0) {
-                  if (fwrite(buf, 1, len, f) < len) {
-                    syslog(LOG_ERR, "Failed to write into a file: %s",
-                            strerror(errno));
-                    break;
-                  }
-                } else {
-                  syslog(LOG_ERR, "No boundary after file contents");
-                }
-              } while (r > 0);
-              if (fclose(f) != 0) {
-                syslog(LOG_ERR, "Failed to close a file: %s", strerror(errno));
+          /* Skip the file contents */
+          while (read_till(boundary, buf, 4096, &len, &matched) > 0);
+        } else {
+          sha256_init(&sha);
+          do {
+            r = read_till(boundary, buf, 4096, &len, &matched);
+            if (r >= 0) {
+              sha256_update(&sha, buf, len);
+              if (fwrite(buf, 1, len, f) < len) {
+                syslog(LOG_ERR, "Failed to write into a file: %s",
+                        strerror(errno));
+                r = -1;
+                break;
               }
-            }
-            ps = FORM_PARSE_START;
-          } else if (strcmp(field_name, "stream") == 0) {
-            if (read_till(boundary, buf, 4096, &len, &matched) == 0) {
-              stream = 1;
-              ps = FORM_PARSE_START;
             } else {
-              syslog(LOG_ERR, "No boundary after stream");
-              ps = FORM_PARSE_FAIL;
+              syslog(LOG_ERR, "No boundary after file contents");
             }
-          } else {
-            /* Skip unknown fields */
-            while (read_till(boundary, buf, 4096, &len, &matched) > 0);
-            ps = FORM_PARSE_START;
+          } while (r > 0);
+          if (fclose(f) != 0) {
+            syslog(LOG_ERR, "Failed to close a file: %s", strerror(errno));
+            r = -1;
+          }
+          if (r != 0 ||
+              store_upload(tmp_name, &sha, form->filename,
+                           form->stored_name, STORED_NAME_LENGTH) != 0) {
+            unlink(tmp_name);
           }
         }
+        if (form->stored_name[0] == '\0') {
+          /* Do not announce a file that was not stored. */
+          form->filename[0] = '\0';
+        }
+        ps = FORM_PARSE_START;
+      } else if (strcmp(field_name, "stream") == 0) {
+        if (read_till(boundary, buf, 4096, &len, &matched) == 0) {
+          form->stream = 1;
+          ps = FORM_PARSE_START;
+        } else {
+          syslog(LOG_ERR, "No boundary after stream");
+          ps = FORM_PARSE_FAIL;
+        }
+      } else {
+        /* Skip unknown fields */
+        while (read_till(boundary, buf, 4096, &len, &matched) > 0);
+        ps = FORM_PARSE_START;
       }
+    }
+  }
+  return ps == FORM_PARSE_DONE ? 0 : -1;
+}
+
+/* Fills in a new file upload message: the stored file name, followed
+   by the one to display. */
+void upload_message (struct bwchat_message *msg, const char *stored_name,
+                     char *filename)
+{
+  char *display_name = basename(filename);
+  msg->type = BWC_MESSAGE_UPLOAD;
+  strcpy(msg->data, stored_name);
+  strcpy(msg->data + strlen(stored_name) + 1, display_name);
+  msg->data_len = strlen(stored_name) + 1 + strlen(display_name);
+}
+
+/* Submits a new message, preceded by the command in buf, and closes
+   the connection. */
+void message_submit (char *buf) {
+  if (write(sock, buf, sizeof(struct bwchat_message) + 1) !=
+      sizeof(struct bwchat_message) + 1) {
+    syslog(LOG_ERR, "Failed to submit a new message: %s", strerror(errno));
+  }
+  /* Wait for the server to close the connection, so that the new
+     message is in the shared history by the time it is read. */
+  while (read(sock, buf, 1) > 0);
+  close(sock);
+  sock = -1;
+}
+
+int handle_chat () {
+  static struct form form;
+  char
+    *request_method = getenv("REQUEST_METHOD"),
+    *content_type = getenv("CONTENT_TYPE");
+
+  form_reset(&form);
+  if (strcmp(request_method, "POST") == 0) {
+    if (content_type != NULL &&
+        strncmp(content_type, "multipart/form-data;", 20) == 0) {
+      parse_form(content_type, &form);
 
       /* Process the parsed form data */
-      if (nick[0] != '\0') {
+      if (form.nick[0] != '\0' && sock_conn() >= 0) {
         char buf[sizeof(struct bwchat_message) + 1];
         struct bwchat_message *msg = (struct bwchat_message *)(buf + 1);
+        /* Not to leak stack contents into the history */
+        memset(buf, 0, sizeof(buf));
         time(&(msg->timestamp));
-        strncpy(msg->nick, nick, BWC_NICK_LENGTH);
+        strncpy(msg->nick, form.nick, BWC_NICK_LENGTH);
         msg->nick[sizeof(msg->nick) - 1] = '\0';
         buf[0] = BWC_CMD_ADD_MESSAGE;
-        if (stream && message_len > 0) {
+        if (form.stream && form.message_len > 0) {
           /* A chunk of stream */
           msg->type = BWC_MESSAGE_AUDIO;
-          msg->data_len = message_len;
-          memcpy(msg->data, message, BWC_MESSAGE_LENGTH);
-          len = write(sock, buf, sizeof(buf));
-        } else if (message[0] != '\0' || filename[0] != '\0') {
+          msg->data_len = form.message_len;
+          /* Only the chunk itself: the rest of form.message holds
+             leftovers of earlier requests. An oversized chunk gets
+             rejected by the server. */
+          memcpy(msg->data, form.message,
+                 form.message_len < BWC_MESSAGE_LENGTH ?
+                 form.message_len : BWC_MESSAGE_LENGTH);
+          if (write(sock, buf, sizeof(buf)) != sizeof(buf)) {
+            syslog(LOG_ERR, "Failed to submit a stream chunk: %s",
+                   strerror(errno));
+          }
+        } else if (form.message[0] != '\0' || form.filename[0] != '\0') {
           /* A new message: either textual or file upload. */
-          if (message[0] != '\0') {
+          if (form.message[0] != '\0') {
             /* New text message */
             msg->type = BWC_MESSAGE_TEXT;
-            strncpy(msg->data, message, BWC_MESSAGE_LENGTH);
+            strncpy(msg->data, form.message, BWC_MESSAGE_LENGTH);
             msg->data[sizeof(msg->data) - 1] = '\0';
-          } else if (filename[0] != '\0') {
-            /* New file upload message */
-            msg->type = BWC_MESSAGE_UPLOAD;
-            strncpy(msg->data, filename, FILENAME_LENGTH);
-          }
-          msg->data_len = strlen(msg->data);
-          if (write(sock, buf, sizeof(buf)) != sizeof(buf)) {
-            syslog(LOG_ERR, "Failed to submit a new message: %s",
-                    strerror(errno));
-          }
-          /* Reopen the socket, since we will request messages after. */
-          if (close(sock) < 0) {
-            syslog(LOG_ERR, "Socket closing error: %s", strerror(errno));
-          }
-          if (sock_conn() < 0) {
-            syslog(LOG_ERR, "Failed to reconnect to the chat server: %s",
-                    strerror(errno));
-            return -1;
+            msg->data_len = strlen(msg->data);
+          } else if (form.filename[0] != '\0') {
+            upload_message(msg, form.stored_name, form.filename);
           }
+          message_submit(buf);
         }
       }
     }
   }
 
   /* Send a response to the client */
-  if (stream) {
-    printf("Content-type: text/html\r\n"
-           "\r\n");
+  if (form.stream) {
+    out_puts("Content-type: text/html\r\n"
+             "\r\n");
   } else {
-    printf
+    out_printf
       ("Content-type: text/html\r\n"
        "\r\n"
        "<!DOCTYPE html>\n"
@@ -545,8 +1083,12 @@ int handle_chat () {
        "  </head>\n"
        "  <body>\n",
        js_url);
+    if (room_player) {
+      out_puts("    <audio controls=\"\" preload=\"none\" src=\"room\">"
+               "</audio>\n");
+    }
     print_messages();
-    printf
+    out_printf
       ("    <form id=\"chatInputForm\" method=\"post\""
        " enctype=\"multipart/form-data\" >\n"
        "      <input type=\"text\" name=\"nick\" value=\"%s\" />\n"
@@ -557,16 +1099,452 @@ int handle_chat () {
        "    </form>\n"
        "  </body>\n"
        "</html>\n",
-       (nick[0] != '\0') ? nick : "Anonymous");
+       (form.nick[0] != '\0') ? form.nick : "Anonymous");
   }
   return 0;
 }
 
+/* Resumable uploads: a session is created with the file's size and
+   name, byte ranges of the file are then written at their offsets, in
+   any order and possibly in parallel, and once all of them are
+   received, the upload is finished: stored and announced like one
+   made at once. A session consists of a partial file, and a file
+   listing its size and name, followed by the ranges received, one
+   "offset length" line per chunk, both in partial_dir. Chunks are
+   written under a shared lock on the partial file, and an upload is
+   finished under an exclusive one, so that no chunk is still written
+   into a stored file. */
+
+/* Writes the headers of a response to an upload request. */
+int upload_headers (const char *status) {
+  return out_printf("Status: %s\r\n"
+                    "Content-type: text/plain\r\n"
+                    "Cache-Control: no-cache\r\n"
+                    "\r\n",
+                    status);
+}
+
+/* Writes a response consisting of a line of text. */
+int upload_respond (const char *status, const char *text) {
+  if (upload_headers(status) < 0) {
+    return -1;
+  }
+  return out_printf("%s\n", text);
+}
+
+/* Parses an unsigned decimal number, returning 0 on success. */
+int parse_ulong (const char *str, unsigned long *value) {
+  char *end;
+  if (! isdigit((unsigned char)str[0])) {
+    return -1;
+  }
+  errno = 0;
+  *value = strtoul(str, &end, 10);
+  return (*end != '\0' || errno != 0) ? -1 : 0;
+}
+
+/* Builds the session file names for an ID, returning 0 on success. */
+int upload_names (const char *id, char *data_name, char *ranges_name) {
+  return (snprintf(data_name, UPLOAD_NAME_LENGTH, "%s/partial-%s",
+                   partial_dir, id) >= UPLOAD_NAME_LENGTH ||
+          snprintf(ranges_name, UPLOAD_NAME_LENGTH, "%s/partial-%s.ranges",
+                   partial_dir, id) >= UPLOAD_NAME_LENGTH) ? -1 : 0;
+}
+
+/* Finds the session files by the "id" query parameter, returning 0 if
+   it is well-formed. */
+int upload_session (const char *query, char *data_name, char *ranges_name) {
+  char id[UPLOAD_ID_LENGTH + 2];
+  size_t i;
+  query_param(query, "id", id, sizeof(id));
+  if (strlen(id) != UPLOAD_ID_LENGTH) {
+    return -1;
+  }
+  for (i = 0; i < UPLOAD_ID_LENGTH; i++) {
+    if (! isxdigit((unsigned char)id[i])) {
+      return -1;
+    }
+  }
+  return upload_names(id, data_name, ranges_name);
+}
+
+static int range_cmp (const void *a, const void *b) {
+  unsigned long
+    x = ((const struct upload_range *)a)->offset,
+    y = ((const struct upload_range *)b)->offset;
+  return x < y ? -1 : x > y;
+}
+
+/* Reads a session's file size and name, and, unless ranges is NULL,
+   the received ranges, sorted and merged. Returns the number of
+   ranges, or -1 on failure; the ranges are to be freed by the
+   caller. */
+long upload_ranges (const char *ranges_name, unsigned long *size,
+                    char *filename, struct upload_range **ranges)
+{
+  char header[32 + FILENAME_LENGTH], *name;
+  struct upload_range *r = NULL, *tmp;
+  unsigned long offset, length, end;
+  long n = 0, allocated = 0, i, j;
+  FILE *f = fopen(ranges_name, "r");
+  if (f == NULL) {
+    return -1;
+  }
+  if (fgets(header, sizeof(header), f) == NULL ||
+      (name = strchr(header, ' ')) == NULL) {
+    fclose(f);
+    return -1;
+  }
+  *name++ = '\0';
+  name[strcspn(name, "\n")] = '\0';
+  if (parse_ulong(header, size) != 0) {
+    fclose(f);
+    return -1;
+  }
+  strncpy(filename, name, FILENAME_LENGTH);
+  filename[FILENAME_LENGTH - 1] = '\0';
+  if (ranges == NULL) {
+    fclose(f);
+    return 0;
+  }
+  while (fscanf(f, "%lu %lu", &offset, &length) == 2) {
+    if (n == allocated) {
+      allocated = allocated > 0 ? allocated * 2 : 64;
+      tmp = realloc(r, allocated * sizeof(struct upload_range));
+      if (tmp == NULL) {
+        free(r);
+        fclose(f);
+        return -1;
+      }
+      r = tmp;
+    }
+    r[n].offset = offset;
+    r[n].length = length;
+    n++;
+  }
+  fclose(f);
+  if (n > 0) {
+    qsort(r, n, sizeof(struct upload_range), range_cmp);
+  }
+  for (i = 0, j = 0; i < n; i++) {
+    if (j > 0 && r[i].offset <= r[j - 1].offset + r[j - 1].length) {
+      end = r[i].offset + r[i].length;
+      if (end > r[j - 1].offset + r[j - 1].length) {
+        r[j - 1].length = end - r[j - 1].offset;
+      }
+    } else if (r[i].length > 0) {
+      r[j++] = r[i];
+    }
+  }
+  *ranges = r;
+  return j;
+}
+
+/* Removes the files of sessions not updated for partial_expiry
+   seconds, except for those being finished. */
+void upload_expire () {
+  char name[UPLOAD_NAME_LENGTH];
+  struct dirent *entry;
+  struct stat st;
+  time_t now = time(NULL);
+  DIR *dir;
+  int fd;
+  if (partial_expiry <= 0 || (dir = opendir(partial_dir)) == NULL) {
+    return;
+  }
+  while ((entry = readdir(dir)) != NULL) {
+    if (strncmp(entry->d_name, "partial-", 8) != 0 ||
+        snprintf(name, sizeof(name), "%s/%s", partial_dir, entry->d_name)
+        >= (int)sizeof(name) ||
+        stat(name, &st) != 0 || now - st.st_mtime < partial_expiry) {
+      continue;
+    }
+    fd = open(name, O_RDONLY);
+    if (fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) == 0) {
+      syslog(LOG_INFO, "Removing an expired upload session file %s", name);
+      unlink(name);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  closedir(dir);
+}
+
+/* Creates a session, responding with its ID. */
+int upload_create (const char *query) {
+  char size_str[32], filename[FILENAME_LENGTH], id[UPLOAD_ID_LENGTH + 1],
+    data_name[UPLOAD_NAME_LENGTH], ranges_name[UPLOAD_NAME_LENGTH];
+  unsigned char bytes[UPLOAD_ID_LENGTH / 2];
+  unsigned long size;
+  size_t i;
+  int fd;
+  FILE *f;
+  query_param(query, "size", size_str, sizeof(size_str));
+  query_param(query, "name", filename, sizeof(filename));
+  if (parse_ulong(size_str, &size) != 0 || filename[0] == '\0') {
+    return upload_respond("400 Bad Request", "A size and a name are required");
+  }
+  for (i = 0; filename[i] != '\0'; i++) {
+    if (iscntrl((unsigned char)filename[i])) {
+      filename[i] = '_';
+    }
+  }
+  fd = open("/dev/urandom", O_RDONLY);
+  if (fd < 0 || read(fd, bytes, sizeof(bytes)) != sizeof(bytes)) {
+    syslog(LOG_ERR, "Failed to read /dev/urandom: %s", strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return upload_respond("500 Internal Server Error", "No session created");
+  }
+  close(fd);
+  for (i = 0; i < sizeof(bytes); i++) {
+    sprintf(id + i * 2, "%02x", bytes[i]);
+  }
+  if (upload_names(id, data_name, ranges_name) != 0) {
+    syslog(LOG_ERR, "The partial upload directory name is too long");
+    return upload_respond("500 Internal Server Error", "No session created");
+  }
+  if (mkdir(partial_dir, 0700) != 0 && errno != EEXIST) {
+    syslog(LOG_ERR, "Failed to create %s: %s", partial_dir, strerror(errno));
+    return upload_respond("500 Internal Server Error", "No session created");
+  }
+  upload_expire();
+  /* As with fopen(3), the umask applies. */
+  fd = open(data_name, O_WRONLY | O_CREAT | O_EXCL, 0666);
+  if (fd < 0) {
+    syslog(LOG_ERR, "Failed to create a file: %s", strerror(errno));
+    return upload_respond("500 Internal Server Error", "No session created");
+  }
+  close(fd);
+  f = fopen(ranges_name, "w");
+  if (f == NULL || fprintf(f, "%lu %s\n", size, filename) < 0 ||
+      fclose(f) != 0) {
+    syslog(LOG_ERR, "Failed to write a file: %s", strerror(errno));
+    unlink(data_name);
+    unlink(ranges_name);
+    return upload_respond("500 Internal Server Error", "No session created");
+  }
+  if (upload_headers("201 Created") < 0) {
+    return -1;
+  }
+  return out_printf("%s\n", id);
+}
+
+/* Writes the request body at the "offset" query parameter, and
+   records the range written, even if the body is cut short. */
+int upload_chunk (const char *query) {
+  static char buf[64 * 1024];
+  char offset_str[32], filename[FILENAME_LENGTH], range[64],
+    data_name[UPLOAD_NAME_LENGTH], ranges_name[UPLOAD_NAME_LENGTH];
+  const char *content_length = getenv("CONTENT_LENGTH"),
+    *request_method = getenv("REQUEST_METHOD");
+  unsigned long size, offset, length = 0, done = 0;
+  size_t len;
+  int fd, ranges_fd;
+  if (request_method == NULL || (strcmp(request_method, "POST") != 0 &&
+                                 strcmp(request_method, "PUT") != 0)) {
+    if (out_puts("Allow: POST, PUT\r\n") < 0) {
+      return -1;
+    }
+    return upload_respond("405 Method Not Allowed",
+                          "Chunks are sent with POST or PUT");
+  }
+  if (upload_session(query, data_name, ranges_name) != 0) {
+    return upload_respond("400 Bad Request", "Invalid session ID");
+  }
+  query_param(query, "offset", offset_str, sizeof(offset_str));
+  if (parse_ulong(offset_str, &offset) != 0 ||
+      content_length == NULL || parse_ulong(content_length, &length) != 0) {
+    return upload_respond("400 Bad Request", "An offset and a body are required");
+  }
+  fd = open(data_name, O_WRONLY);
+  if (fd < 0) {
+    return upload_respond("404 Not Found", "No such session");
+  }
+  /* The session is over if it got finished while waiting for the
+     lock. */
+  if (flock(fd, LOCK_SH) != 0 ||
+      upload_ranges(ranges_name, &size, filename, NULL) < 0) {
+    close(fd);
+    return upload_respond("404 Not Found", "No such session");
+  }
+  if (offset > size || length > size - offset) {
+    close(fd);
+    return upload_respond("400 Bad Request", "The chunk is out of bounds");
+  }
+  while (done < length) {
+    len = in_read(buf, length - done < sizeof(buf) ?
+                  length - done : sizeof(buf));
+    if (len == 0) {
+      break;
+    }
+    if (pwrite(fd, buf, len, offset + done) != (ssize_t)len) {
+      syslog(LOG_ERR, "Failed to write into a file: %s", strerror(errno));
+      break;
+    }
+    done += len;
+  }
+  if (done > 0) {
+    /* A single small write with O_APPEND does not interleave with
+       those of parallel requests. */
+    len = sprintf(range, "%lu %lu\n", offset, done);
+    ranges_fd = open(ranges_name, O_WRONLY | O_APPEND);
+    if (ranges_fd < 0 || write(ranges_fd, range, len) != (ssize_t)len) {
+      syslog(LOG_ERR, "Failed to record a range: %s", strerror(errno));
+      done = 0;
+    }
+    if (ranges_fd >= 0) {
+      close(ranges_fd);
+    }
+  }
+  /* Releasing the lock once the range is recorded */
+  close(fd);
+  if (done < length) {
+    return upload_respond("500 Internal Server Error",
+                        "The chunk is not written completely");
+  }
+  return upload_respond("200 OK", "ok");
+}
+
+/* Responds with the file size, followed by the received ranges. */
+int upload_status (const char *query) {
+  char filename[FILENAME_LENGTH],
+    data_name[UPLOAD_NAME_LENGTH], ranges_name[UPLOAD_NAME_LENGTH];
+  struct upload_range *ranges = NULL;
+  unsigned long size;
+  long n, i;
+  if (upload_session(query, data_name, ranges_name) != 0) {
+    return upload_respond("400 Bad Request", "Invalid session ID");
+  }
+  n = upload_ranges(ranges_name, &size, filename, &ranges);
+  if (n < 0) {
+    return upload_respond("404 Not Found", "No such session");
+  }
+  if (upload_headers("200 OK") < 0 || out_printf("%lu\n", size) < 0) {
+    free(ranges);
+    return -1;
+  }
+  for (i = 0; i < n; i++) {
+    if (out_printf("%lu %lu\n", ranges[i].offset, ranges[i].length) < 0) {
+      break;
+    }
+  }
+  free(ranges);
+  return 0;
+}
+
+/* Stores a completely received file, and announces it on behalf of
+   the "nick" query parameter. */
+int upload_finish (const char *query) {
+  static char buf[sizeof(struct bwchat_message) + 1];
+  struct bwchat_message *msg = (struct bwchat_message *)(buf + 1);
+  char nick[BWC_NICK_LENGTH], filename[FILENAME_LENGTH],
+    stored_name[STORED_NAME_LENGTH], data_name[UPLOAD_NAME_LENGTH],
+    ranges_name[UPLOAD_NAME_LENGTH];
+  struct upload_range *ranges = NULL;
+  struct sha256_ctx sha;
+  unsigned long size;
+  size_t len;
+  long n;
+  int complete, fd;
+  FILE *f;
+  if (upload_session(query, data_name, ranges_name) != 0) {
+    return upload_respond("400 Bad Request", "Invalid session ID");
+  }
+  query_param(query, "nick", nick, sizeof(nick));
+  if (nick[0] == '\0') {
+    return upload_respond("400 Bad Request", "A nick is required");
+  }
+  /* Waiting for the chunks being written, and for parallel requests
+     to finish, which then find the session over. */
+  fd = open(data_name, O_RDONLY);
+  if (fd < 0) {
+    return upload_respond("404 Not Found", "No such session");
+  }
+  if (flock(fd, LOCK_EX) != 0 ||
+      (n = upload_ranges(ranges_name, &size, filename, &ranges)) < 0) {
+    close(fd);
+    return upload_respond("404 Not Found", "No such session");
+  }
+  complete = size == 0 ||
+    (n == 1 && ranges[0].offset == 0 && ranges[0].length >= size);
+  free(ranges);
+  if (! complete) {
+    close(fd);
+    return upload_respond("409 Conflict", "The upload is incomplete");
+  }
+  if (sock_conn() < 0) {
+    close(fd);
+    return upload_respond("503 Service Unavailable",
+                        "The chat server is not available");
+  }
+  unlink(ranges_name);
+  f = fdopen(fd, "r");
+  if (f == NULL) {
+    syslog(LOG_ERR, "Failed to open a file: %s", strerror(errno));
+    close(fd);
+    unlink(data_name);
+    return upload_respond("500 Internal Server Error", "Failed to store");
+  }
+  sha256_init(&sha);
+  while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
+    sha256_update(&sha, buf, len);
+  }
+  if (store_upload(data_name, &sha, filename, stored_name,
+                   STORED_NAME_LENGTH) != 0) {
+    unlink(data_name);
+    fclose(f);
+    return upload_respond("500 Internal Server Error", "Failed to store");
+  }
+  fclose(f);
+  memset(buf, 0, sizeof(buf));
+  buf[0] = BWC_CMD_ADD_MESSAGE;
+  time(&(msg->timestamp));
+  strncpy(msg->nick, nick, BWC_NICK_LENGTH);
+  msg->nick[BWC_NICK_LENGTH - 1] = '\0';
+  upload_message(msg, stored_name, filename);
+  message_submit(buf);
+  return upload_respond("200 OK", stored_name);
+}
+
+/* Serves resumable uploads, by the "action" query parameter. */
+int serve_upload () {
+  const char *query = getenv("QUERY_STRING");
+  char action[16];
+  query_param(query, "action", action, sizeof(action));
+  if (strcmp(action, "create") == 0) {
+    return upload_create(query);
+  } else if (strcmp(action, "chunk") == 0) {
+    return upload_chunk(query);
+  } else if (strcmp(action, "status") == 0) {
+    return upload_status(query);
+  } else if (strcmp(action, "finish") == 0) {
+    return upload_finish(query);
+  }
+  return upload_respond("400 Bad Request", "Unknown action");
+}
+
+#ifndef BWC_BENCH
+/* Benchmarks provide their own main(). */
 static struct argp_option options[] = {
+  {"coalesce-bytes", 'b', "BYTES", 0,
+   "Flush streamed output once this much is pending", 0 },
+  {"coalesce-ms", 'c', "MS", 0,
+   "A time window to coalesce streamed output within", 0 },
+  {"partial-expiry", 'e', "SECONDS", 0,
+   "Remove incomplete uploads not updated for this long", 0 },
   {"js-url", 'j', "URL", 0,
    "JavaScript (bwchat.js) URL to reference from HTML", 0 },
   {"log-stderr", 'l', 0, 0,
    "Write logs into stderr, in addition to syslog", 0 },
+  {"shm-name", 'm', "NAME", 0,
+   "The bwchat-server's shared memory object name", 0 },
+  {"partial-dir", 'p', "DIR", 0,
+   "A directory to keep incomplete resumable uploads in", 0 },
+  {"room", 'r', 0, 0,
+   "Show a player of the room mix, for a server mixing audio", 0 },
   {"socket-path", 's', "PATH", 0,
    "The bwchat-server's Unix domain socket path", 0 },
   {"upload-dir-url", 'u', "URL", 0,
@@ -576,15 +1554,33 @@ static struct argp_option options[] = {
 static error_t parse_opt (int key, char *arg, struct argp_state *state) {
   (void)state;
   switch (key) {
+  case 'b':
+    coalesce_bytes = strtoul(arg, NULL, 10);
+    break;
+  case 'c':
+    coalesce_ms = strtol(arg, NULL, 10);
+    break;
   case 'u':
     upload_dir_url = arg;
     break;
+  case 'e':
+    partial_expiry = strtol(arg, NULL, 10);
+    break;
   case 'j':
     js_url = arg;
     break;
+  case 'm':
+    shm_name = arg;
+    break;
+  case 'p':
+    partial_dir = arg;
+    break;
   case 's':
     sock_path = arg;
     break;
+  case 'r':
+    room_player = 1;
+    break;
   case 'l':
     log_stderr = LOG_PERROR;
     break;
@@ -604,30 +1600,33 @@ int main (int argc, char **argv) {
   while (FCGI_Accept() >= 0) {
 #endif
     char *script_name, *script_bname;
-    if (sock_conn() < 0) {
-      syslog(LOG_DEBUG,
-             "Failed to connect to the chat server at %s: %s",
-             sock_path, strerror(errno));
-#ifdef HAVE_FCGI
-      continue;
-#else
-      return -1;
-#endif
-    }
+    in_pos = 0;
+    in_len = 0;
     script_name = getenv("SCRIPT_NAME");
     script_bname = basename(script_name);
     if (strcmp(script_bname, "stream") == 0) {
-      serve_stream();
+      serve_stream(0);
+    } else if (strcmp(script_bname, "room") == 0) {
+      serve_stream(1);
     } else if (strcmp(script_bname, "messages") == 0) {
       serve_messages();
+    } else if (strcmp(script_bname, "search") == 0) {
+      serve_search();
+    } else if (strcmp(script_bname, "upload") == 0) {
+      serve_upload();
     } else {
       handle_chat();
     }
-    if (close(sock) < 0) {
-      syslog(LOG_ERR, "Socket closing error: %s", strerror(errno));
+    out_flush();
+    if (sock != -1) {
+      if (close(sock) < 0) {
+        syslog(LOG_ERR, "Socket closing error: %s", strerror(errno));
+      }
+      sock = -1;
     }
 #ifdef HAVE_FCGI
   }
 #endif
   return 0;
 }
+#endif
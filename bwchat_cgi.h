@@ -0,0 +1,45 @@
+/**
+   @file bwchat_cgi.h
+   @brief bwchat CGI internals, shared with benchmarks
+   @author defanor <defanor@thunix.net>
+   @date 2024
+   @copyright MIT license
+*/
+
+/* To be included after bwchat.h and sha256.h */
+
+#define BOUNDARY_LENGTH 128
+#define FILENAME_LENGTH 128
+#define EXTENSION_LENGTH 16
+#define STORED_NAME_LENGTH (SHA256_DIGEST_LENGTH * 2 + 1 + EXTENSION_LENGTH)
+#define IN_BUF_SIZE 4096
+#define OUT_BUF_SIZE (64 * 1024)
+
+/* Parsed form data */
+struct form {
+  char message[BWC_MESSAGE_LENGTH + BOUNDARY_LENGTH + 4];
+  size_t message_len;
+  char nick[BWC_NICK_LENGTH + BOUNDARY_LENGTH + 4];
+  char filename[FILENAME_LENGTH];
+  char stored_name[STORED_NAME_LENGTH];
+  int stream;
+};
+
+/* Input is read in chunks from a source, which is the request body
+   by default: in_read returns the number of bytes written into buf,
+   or 0 at the end of input. Resetting in_pos and in_len discards
+   buffered input. */
+extern size_t (*in_read) (char *buf, size_t len);
+extern size_t in_pos, in_len;
+size_t stdin_read (char *buf, size_t len);
+
+/* Pending output, discarded by resetting out_len */
+extern size_t out_len;
+
+char *html_escape (char *dst, const char *src, size_t sz);
+char *read_param (const char *line, const char *name, char *dst, size_t sz);
+int read_till (const char *end, char *out, size_t out_buf_len,
+               size_t *out_data_len, size_t *matched);
+int print_message (struct bwchat_message *msg, const char *time_format);
+void form_reset (struct form *form);
+int parse_form (const char *content_type, struct form *form);
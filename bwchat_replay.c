@@ -0,0 +1,429 @@
+/**
+   @file bwchat_replay.c
+   @brief Replays captured traffic against a bwchat server
+   @author defanor <defanor@thunix.net>
+   @date 2024
+   @copyright MIT license
+*/
+
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <argp.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include "bwchat.h"
+#include "capture.h"
+
+#define CONNECTION_COUNT 1024
+/* At the maximum speed, the number of one-shot commands to wait for
+   before issuing more */
+#define MAX_PENDING 64
+/* How long to wait for the deliveries after the last record */
+#define GRACE_USEC 2000000UL
+/* The number of recent messages to keep send times of */
+#define SENT_COUNT 4096
+
+/* A replayed connection: a listener, or a one-shot command until the
+   server closes it. */
+struct connection {
+  int sock;
+  /* The captured connection for listeners, -1 for one-shot commands */
+  int conn;
+};
+
+/* Global state */
+struct connection connections[CONNECTION_COUNT];
+int pending = 0;
+/* When a command was last completed, or a message delivered */
+unsigned long finished = 0;
+/* A listener of new messages, to measure delivery latency with */
+int probe_sock = -1;
+struct timespec start;
+/* Send times of text messages and uploads, indexed by their sequence
+   numbers (modulo SENT_COUNT), which replace their timestamps. */
+unsigned long sent_at[SENT_COUNT];
+unsigned long sent_count = 0, undelivered = 0;
+unsigned long *latencies = NULL;
+size_t latency_count = 0, latency_size = 0;
+/* Statistics */
+unsigned long record_count = 0, command_count = 0, failure_count = 0,
+  skip_count = 0, delivery_count = 0, byte_count = 0;
+
+/* Settings */
+const char *sock_path = "bwchat-socket";
+const char *trace_path = NULL;
+double speed = 1;
+
+static struct argp_option options[] = {
+  {"socket-path", 's', "PATH", 0,
+   "The Unix domain socket path to connect to", 0 },
+  {"speed", 'x', "FACTOR", 0,
+   "Replay speed relative to the captured one, 0 for the maximum", 0 },
+  { 0 }
+};
+static error_t parse_opt (int key, char *arg, struct argp_state *state) {
+  switch (key) {
+  case 's':
+    sock_path = arg;
+    break;
+  case 'x':
+    speed = strtod(arg, NULL);
+    if (speed < 0) {
+      argp_error(state, "the speed should not be negative");
+    }
+    break;
+  case ARGP_KEY_ARG:
+    if (trace_path != NULL) {
+      argp_usage(state);
+    }
+    trace_path = arg;
+    break;
+  case ARGP_KEY_END:
+    if (trace_path == NULL) {
+      argp_usage(state);
+    }
+    break;
+  default:
+    return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+static struct argp argp =
+  { options, parse_opt, "CAPTURE",
+    "A basic web chat, a replayer of bwchat-server --capture files", 0, 0, 0 };
+
+/* Returns microseconds since the replay start. */
+unsigned long usec_now () {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start.tv_sec) * 1000000UL +
+    (now.tv_nsec - start.tv_nsec) / 1000;
+}
+
+int sock_connect () {
+  struct sockaddr_un addr;
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (sock < 0) {
+    perror("socket()");
+    return -1;
+  }
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path));
+  addr.sun_path[sizeof(addr.sun_path) - 1] = '\0';
+  if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    perror("connect()");
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+void connection_close (struct connection *c) {
+  close(c->sock);
+  c->sock = -1;
+  if (c->conn == -1) {
+    pending--;
+    finished = usec_now();
+  }
+}
+
+int connection_add (int sock, int conn) {
+  int i;
+  for (i = 0; i < CONNECTION_COUNT; i++) {
+    if (connections[i].sock == -1) {
+      connections[i].sock = sock;
+      connections[i].conn = conn;
+      if (conn == -1) {
+        pending++;
+      }
+      return 0;
+    }
+  }
+  fprintf(stderr, "Too many connections\n");
+  return -1;
+}
+
+/* Closes a replayed listener, corresponding to a captured one. */
+void listener_close (int conn) {
+  int i;
+  for (i = 0; i < CONNECTION_COUNT; i++) {
+    if (connections[i].sock != -1 && connections[i].conn == conn) {
+      connection_close(&(connections[i]));
+    }
+  }
+}
+
+/* Replays a captured command. */
+void replay (const struct capture_record *rec, const char *data) {
+  static char cmd[1 + sizeof(struct bwchat_message)];
+  struct bwchat_message *msg = (struct bwchat_message *)(cmd + 1);
+  size_t len = rec->len;
+  int sock, listener, measure;
+  record_count++;
+  if (rec->len == 0) {
+    listener_close(rec->conn);
+    return;
+  }
+  if (data[0] == BWC_CMD_HANDOVER) {
+    skip_count++;
+    return;
+  }
+  memcpy(cmd, data, len);
+  measure = 0;
+  if (data[0] == BWC_CMD_ADD_MESSAGE && len < sizeof(cmd)) {
+    /* Expand a compacted message. */
+    memcpy(&(msg->data_len), data + 1 + BWC_MESSAGE_HEADER_LENGTH,
+           sizeof(msg->data_len));
+    if (msg->data_len > BWC_MESSAGE_LENGTH ||
+        len != 1 + BWC_MESSAGE_HEADER_LENGTH + sizeof(msg->data_len) +
+        msg->data_len) {
+      skip_count++;
+      return;
+    }
+    memcpy(msg->data,
+           data + 1 + BWC_MESSAGE_HEADER_LENGTH + sizeof(msg->data_len),
+           msg->data_len);
+    memset(msg->data + msg->data_len, 0,
+           BWC_MESSAGE_LENGTH - msg->data_len);
+    len = sizeof(cmd);
+    if (msg->type == BWC_MESSAGE_TEXT || msg->type == BWC_MESSAGE_UPLOAD) {
+      /* Tag it, to find its delivery. */
+      msg->timestamp = sent_count;
+      measure = 1;
+    }
+  }
+  listener = cmd[0] == BWC_CMD_NEW_MESSAGES ||
+    cmd[0] == BWC_CMD_NEW_MESSAGES_HEARTBEAT ||
+    cmd[0] == BWC_CMD_AUDIO_STREAM || cmd[0] == BWC_CMD_ROOM_STREAM ||
+    cmd[0] == BWC_CMD_REPLICATE;
+  if (listener) {
+    /* The captured descriptor is only reused once it is closed. */
+    listener_close(rec->conn);
+  }
+  sock = sock_connect();
+  if (sock < 0) {
+    failure_count++;
+    return;
+  }
+  if (measure) {
+    sent_at[sent_count % SENT_COUNT] = usec_now();
+    sent_count++;
+    undelivered++;
+  }
+  if (write(sock, cmd, len) != (ssize_t)len) {
+    perror("write()");
+    close(sock);
+    failure_count++;
+    undelivered -= measure;
+    return;
+  }
+  if (connection_add(sock, listener ? rec->conn : -1) < 0) {
+    close(sock);
+    failure_count++;
+    undelivered -= measure;
+    return;
+  }
+  command_count++;
+  byte_count += len;
+}
+
+/* Reads a message from the probe listener, recording the delivery
+   latency. */
+int probe_receive () {
+  static struct bwchat_message msg;
+  unsigned long seq;
+  ssize_t len = read(probe_sock, &msg, sizeof(msg));
+  if (len <= 0) {
+    fprintf(stderr, "The server has closed the connection\n");
+    return -1;
+  }
+  if (len != sizeof(msg) ||
+      (msg.type != BWC_MESSAGE_TEXT && msg.type != BWC_MESSAGE_UPLOAD)) {
+    return 0;
+  }
+  delivery_count++;
+  seq = msg.timestamp;
+  if (msg.timestamp < 0 || seq >= sent_count ||
+      seq + SENT_COUNT < sent_count) {
+    /* Not tagged here, or too old. */
+    return 0;
+  }
+  if (latency_count == latency_size) {
+    size_t new_size = latency_size ? latency_size * 2 : 1024;
+    unsigned long *l = realloc(latencies, new_size * sizeof(unsigned long));
+    if (l == NULL) {
+      perror("realloc()");
+      return -1;
+    }
+    latencies = l;
+    latency_size = new_size;
+  }
+  finished = usec_now();
+  latencies[latency_count++] = finished - sent_at[seq % SENT_COUNT];
+  undelivered--;
+  return 0;
+}
+
+/* Reads a record, returns 1 on success, 0 at the end of a trace, -1
+   on failure. */
+int record_read (FILE *trace, struct capture_record *rec, char *data,
+                 size_t size)
+{
+  if (fread(rec, sizeof(*rec), 1, trace) != 1) {
+    return ferror(trace) ? -1 : 0;
+  }
+  if (rec->len > size) {
+    fprintf(stderr, "Invalid record length: %u\n", rec->len);
+    return -1;
+  }
+  if (fread(data, 1, rec->len, trace) != rec->len) {
+    fprintf(stderr, "Truncated record\n");
+    return -1;
+  }
+  return 1;
+}
+
+int latency_cmp (const void *a, const void *b) {
+  unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+  return x < y ? -1 : x > y;
+}
+
+void report (unsigned long elapsed) {
+  double seconds = elapsed / 1000000.0;
+  unsigned long sum = 0;
+  size_t i;
+  printf("records %lu\n"
+         "commands %lu\n"
+         "skipped %lu\n"
+         "failed %lu\n"
+         "delivered %lu\n"
+         "seconds %.3f\n"
+         "commands_per_second %.1f\n"
+         "bytes_per_second %.1f\n"
+         "latency_samples %lu\n",
+         record_count, command_count, skip_count, failure_count,
+         delivery_count, seconds,
+         seconds > 0 ? command_count / seconds : 0,
+         seconds > 0 ? byte_count / seconds : 0,
+         (unsigned long)latency_count);
+  if (latency_count == 0) {
+    return;
+  }
+  qsort(latencies, latency_count, sizeof(unsigned long), latency_cmp);
+  for (i = 0; i < latency_count; i++) {
+    sum += latencies[i];
+  }
+  printf("latency_min_us %lu\n"
+         "latency_avg_us %lu\n"
+         "latency_p50_us %lu\n"
+         "latency_p99_us %lu\n"
+         "latency_max_us %lu\n",
+         latencies[0], sum / latency_count,
+         latencies[latency_count / 2],
+         latencies[latency_count * 99 / 100],
+         latencies[latency_count - 1]);
+}
+
+int main (int argc, char **argv) {
+  static struct pollfd pfds[1 + CONNECTION_COUNT];
+  static char data[2 + sizeof(struct bwchat_message)];
+  static struct bwchat_message buf;
+  char magic[CAPTURE_MAGIC_LENGTH];
+  char c = BWC_CMD_NEW_MESSAGES;
+  struct capture_record rec;
+  FILE *trace;
+  unsigned long now, due = 0, last = 0;
+  long timeout;
+  int i, nfds, have_record;
+
+  argp_parse(&argp, argc, argv, 0, 0, 0);
+  signal(SIGPIPE, SIG_IGN);
+  for (i = 0; i < CONNECTION_COUNT; i++) {
+    connections[i].sock = -1;
+  }
+  trace = fopen(trace_path, "rb");
+  if (trace == NULL) {
+    perror("fopen()");
+    return 1;
+  }
+  if (fread(magic, CAPTURE_MAGIC_LENGTH, 1, trace) != 1 ||
+      memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LENGTH) != 0) {
+    fprintf(stderr, "Not a capture file: %s\n", trace_path);
+    return 1;
+  }
+  probe_sock = sock_connect();
+  if (probe_sock < 0 || write(probe_sock, &c, 1) != 1) {
+    return 1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  have_record = record_read(trace, &rec, data, sizeof(data));
+  while (have_record > 0 || pending > 0 || undelivered > 0) {
+    now = usec_now();
+    if (have_record > 0) {
+      due = speed > 0 ? rec.usec / speed : 0;
+      timeout = due > now ? (long)((due - now + 999) / 1000) : 0;
+      if (speed == 0 && pending >= MAX_PENDING) {
+        timeout = -1;
+      }
+    } else if (now - last >= GRACE_USEC) {
+      break;
+    } else {
+      timeout = (GRACE_USEC - (now - last) + 999) / 1000;
+    }
+
+    pfds[0].fd = probe_sock;
+    pfds[0].events = POLLIN;
+    nfds = 1;
+    for (i = 0; i < CONNECTION_COUNT; i++) {
+      if (connections[i].sock != -1) {
+        pfds[nfds].fd = connections[i].sock;
+        pfds[nfds].events = POLLIN;
+        nfds++;
+      }
+    }
+    if (poll(pfds, nfds, timeout) < 0) {
+      perror("poll()");
+      return 1;
+    }
+    if (pfds[0].revents && probe_receive() < 0) {
+      return 1;
+    }
+    for (i = 0, nfds = 1; i < CONNECTION_COUNT; i++) {
+      if (connections[i].sock != -1) {
+        /* Responses are discarded, and the descriptors are only
+           closed here, so the poll array lines up. */
+        if (pfds[nfds].revents &&
+            read(connections[i].sock, &buf, sizeof(buf)) <= 0) {
+          connection_close(&(connections[i]));
+        }
+        nfds++;
+      }
+    }
+
+    now = usec_now();
+    while (have_record > 0 && due <= now &&
+           ! (speed == 0 && pending >= MAX_PENDING)) {
+      replay(&rec, data);
+      last = now;
+      have_record = record_read(trace, &rec, data, sizeof(data));
+      if (have_record > 0) {
+        due = speed > 0 ? rec.usec / speed : 0;
+      }
+    }
+    if (have_record < 0) {
+      return 1;
+    }
+  }
+
+  report(finished > last ? finished : last);
+  fclose(trace);
+  return 0;
+}
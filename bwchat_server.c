@@ -15,57 +15,232 @@
 #include <stdlib.h>
 #include <syslog.h>
 #include <argp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 
 #include "bwchat.h"
+#include "timer.h"
+#include "search.h"
+#include "probes.h"
+#include "capture.h"
+#ifdef HAVE_OPUS
+#include "mixer.h"
+#endif
+
+#ifdef BWC_RELAY
+#define PROGRAM_NAME "bwchat-relay"
+#else
+#define PROGRAM_NAME "bwchat-server"
+#endif
 
-#define MESSAGE_COUNT 20
+#define MESSAGE_COUNT BWC_MESSAGE_COUNT
 #define LISTENER_COUNT 128
+#define TIMER_TICK_MS 100
+/* Idle message listeners get a heartbeat after this many ticks. */
+#define HEARTBEAT_TICKS (10000 / TIMER_TICK_MS)
+/* Audio streams end after this many ticks without new data. */
+#define STREAM_TIMEOUT_TICKS (10000 / TIMER_TICK_MS)
+/* A handover fails if the new server stalls for this many seconds. */
+#define HANDOVER_TIMEOUT 5
+/* Work is done in the order of priority: new clients (with their text
+   messages and control commands) first, then up to AUDIO_BUDGET bytes
+   of queued audio stream writes, then a history dump, and over
+   again. */
+#define ACCEPT_BATCH 16
+#define AUDIO_BUDGET (256 * 1024)
+#define AUDIO_QUEUE_LENGTH 64
+#define DUMP_QUEUE_LENGTH LISTENER_COUNT
+#ifdef HAVE_OPUS
+/* The room mix is produced a page per tick. */
+#define ROOM_FRAMES (TIMER_TICK_MS / MIXER_FRAME_MS)
+#endif
+
+struct message_listener {
+  int sock;
+  /* Whether the listener asked for heartbeats */
+  int heartbeats;
+  struct timer heartbeat;
+};
 
 struct stream_listener {
   int sock;
   struct bwchat_message *msg;
 };
 
+/* An audio stream chunk, being passed to the stream's listeners */
+struct audio_job {
+  /* The stream, or NULL if the job is cancelled */
+  struct bwchat_message *msg;
+  /* The next stream listener to write the chunk to */
+  int listener;
+  size_t len;
+  char data[BWC_MESSAGE_LENGTH];
+};
+
+/* A relay's subscription to an upstream audio stream */
+struct upstream_stream {
+  int sock;
+};
+
+/* The first packet of a state handover, carrying the listening socket
+   and the shared history object (if there is one), followed by
+   MESSAGE_COUNT messages, a packet with message listener sockets (if
+   there are any), carrying their heartbeat flags, and one with stream
+   listener sockets (if there are any), carrying indices of the
+   messages they listen to.
+   Then the new server acknowledges the state with a byte, and the old
+   one confirms that it exits with another. */
+struct handover_header {
+  unsigned int oldest;
+  unsigned int message_listener_count;
+  unsigned int stream_listener_count;
+};
+
 /* Global state */
 int server_sock = -1, client_sock = -1;
-int message_listeners[LISTENER_COUNT];
+struct message_listener message_listeners[LISTENER_COUNT];
 struct stream_listener stream_listeners[LISTENER_COUNT];
+struct timer_wheel timers;
+struct timer stream_timers[MESSAGE_COUNT];
+/* Queued work: audio chunks, and clients waiting for history dumps */
+struct audio_job audio_queue[AUDIO_QUEUE_LENGTH];
+unsigned int audio_first = 0, audio_count = 0;
+int dump_queue[DUMP_QUEUE_LENGTH];
+unsigned int dump_first = 0, dump_count = 0;
+int upstream_sock = -1;
+struct upstream_stream upstream_streams[MESSAGE_COUNT];
+struct bwchat_history *history = NULL;
+int history_shared = 0;
+int history_fd = -1;
 int log_stderr = 0;
+/* The message archive: file offsets of its records, indexed by record
+   number, and a search index over the same numbers */
+int archive_fd = -1;
+off_t *archive_offsets = NULL;
+unsigned long archive_count = 0, archive_size = 0;
+off_t archive_end = 0;
+struct search_index archive_index;
+/* The traffic capture, and the time it started at */
+FILE *capture = NULL;
+struct timespec capture_start;
+#ifdef HAVE_OPUS
+/* The room mix: all the audio streams mixed into one, with its header
+   pages as the message data, and its listeners among the stream
+   listeners. */
+struct bwchat_message room;
+struct timer room_timer;
+#endif
 
 /* Settings */
+#ifdef BWC_RELAY
+const char *sock_path = "bwchat-relay-socket";
+/* Each relay on a host needs its own, so there is no default. */
+const char *shm_name = NULL;
+#else
 const char *sock_path = "bwchat-socket";
+const char *shm_name = "/bwchat-history";
+#endif
+const char *upstream_path = NULL;
+const char *archive_path = NULL;
+const char *capture_path = NULL;
+int take_over = 0;
+int room_mix = 0;
 
 static struct argp_option options[] = {
+#ifndef BWC_RELAY
+  {"archive", 'a', "PATH", 0,
+   "A file to archive messages in, making them searchable", 0 },
+#endif
+  {"capture", 'c', "PATH", 0,
+   "Record incoming commands into a file, for bwchat-replay", 0 },
   {"log-stderr", 'l', 0, 0,
    "Write logs into stderr, in addition to syslog", 0 },
+  {"shm-name", 'm', "NAME", 0,
+   "The shared memory object name to publish message history in", 0 },
+#ifdef HAVE_OPUS
+  {"room-mix", 'r', 0, 0,
+   "Mix audio streams into a single room stream", 0 },
+#endif
   {"socket-path", 's', "PATH", 0,
    "The Unix domain socket path to listen on", 0 },
+#ifdef BWC_RELAY
+  {"upstream", 'u', "PATH", 0,
+   "The upstream server's (or relay's) socket path", 0 },
+#else
+  {"take-over", 't', 0, 0,
+   "Take over the socket, listeners, and history from a running server", 0 },
+#endif
   { 0 }
 };
 static error_t parse_opt (int key, char *arg, struct argp_state *state) {
   (void)state;
   switch (key) {
+  case 'a':
+    archive_path = arg;
+    break;
+  case 'c':
+    capture_path = arg;
+    break;
   case 's':
     sock_path = arg;
     break;
   case 'l':
     log_stderr = LOG_PERROR;
     break;
+  case 'm':
+    shm_name = arg;
+    break;
+  case 'r':
+    room_mix = 1;
+    break;
+  case 't':
+    take_over = 1;
+    break;
+  case 'u':
+    upstream_path = arg;
+    break;
+#ifdef BWC_RELAY
+  case ARGP_KEY_END:
+    if (upstream_path == NULL) {
+      argp_error(state, "an upstream socket path is required");
+    }
+    if (shm_name == NULL) {
+      argp_error(state, "a shared memory object name is required");
+    }
+    break;
+#endif
   default:
     return ARGP_ERR_UNKNOWN;
   }
   return 0;
 }
+#ifdef BWC_RELAY
+static struct argp argp =
+  { options, parse_opt, 0,
+    "A basic web chat, a relay mirroring an upstream chat server", 0, 0, 0 };
+#else
 static struct argp argp =
   { options, parse_opt, 0, "A basic web chat, the chat server", 0, 0, 0 };
+#endif
 
-void terminate (int signum) {
+/* Closes the sockets, removes the socket file and shared memory. */
+void cleanup () {
   int i;
-  syslog(LOG_DEBUG, "Received signal %d, terminating", signum);
   for (i = 0; i < LISTENER_COUNT; i++) {
-    if (message_listeners[i] != -1) {
-      close(message_listeners[i]);
-      message_listeners[i] = -1;
+    if (message_listeners[i].sock != -1) {
+      close(message_listeners[i].sock);
+      message_listeners[i].sock = -1;
     }
     if (stream_listeners[i].sock != -1) {
       close(stream_listeners[i].sock);
@@ -76,41 +251,355 @@ void terminate (int signum) {
     close(client_sock);
     client_sock = -1;
   }
+  for (i = 0; i < MESSAGE_COUNT; i++) {
+    if (upstream_streams[i].sock != -1) {
+      close(upstream_streams[i].sock);
+      upstream_streams[i].sock = -1;
+    }
+  }
+  if (upstream_sock != -1) {
+    close(upstream_sock);
+    upstream_sock = -1;
+  }
+  if (archive_fd != -1) {
+    close(archive_fd);
+    archive_fd = -1;
+  }
+  if (capture != NULL) {
+    fclose(capture);
+    capture = NULL;
+  }
   close(server_sock);
   server_sock = -1;
   unlink(sock_path);
+  if (history_shared) {
+    shm_unlink(shm_name);
+  }
+}
+
+void terminate (int signum) {
+  syslog(LOG_DEBUG, "Received signal %d, terminating", signum);
+  cleanup();
   exit(0);
 }
 
-/*
-  https://www.xiph.org/ogg/doc/framing.html -- Ogg
-  https://www.rfc-editor.org/rfc/rfc7845#section-5 -- Opus
-*/
+/* Maps the message history, shared with clients if possible. The
+   shared memory object stays locked while a server uses it: a locked
+   one belongs to another running server, and is left alone, while a
+   leftover one is unlinked first, so that clients still mapping it
+   notice that it is stale. Returns NULL on failure. */
+struct bwchat_history *history_map () {
+  struct bwchat_history *h = MAP_FAILED;
+  int fd;
+  fd = shm_open(shm_name, O_RDWR, 0);
+  if (fd >= 0) {
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+      syslog(LOG_ERR, "Failed to lock %s, used by another server? %s",
+             shm_name, strerror(errno));
+      close(fd);
+      return NULL;
+    }
+    close(fd);
+    shm_unlink(shm_name);
+  }
+  fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) {
+    syslog(LOG_WARNING, "shm_open() failure: %s", strerror(errno));
+  } else {
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+      syslog(LOG_WARNING, "flock() failure: %s", strerror(errno));
+    } else if (ftruncate(fd, sizeof(struct bwchat_history)) < 0) {
+      syslog(LOG_WARNING, "ftruncate() failure: %s", strerror(errno));
+    } else {
+      h = mmap(NULL, sizeof(struct bwchat_history), PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+      if (h == MAP_FAILED) {
+        syslog(LOG_WARNING, "mmap() failure: %s", strerror(errno));
+      }
+    }
+    if (h != MAP_FAILED) {
+      /* Keeping the descriptor, and the lock with it. */
+      history_fd = fd;
+      history_shared = 1;
+      return h;
+    }
+    close(fd);
+    shm_unlink(shm_name);
+  }
+  syslog(LOG_WARNING, "Keeping the message history private");
+  return malloc(sizeof(struct bwchat_history));
+}
 
-int main (int argc, char **argv) {
-  unsigned int oldest_message = 0;
-  struct bwchat_message messages[MESSAGE_COUNT];
-  struct sockaddr_un server_addr, client_addr;
-  socklen_t server_addr_size, client_addr_size;
-  char buf[1 + sizeof(struct bwchat_message)];
-  int i;
-  ssize_t len;
+/* Maps the shared message history handed over by another server,
+   along with its lock. Returns NULL on failure. */
+struct bwchat_history *history_attach (int fd) {
+  struct bwchat_history *h;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct bwchat_history)) {
+    syslog(LOG_ERR, "Received an unsuitable history object");
+    close(fd);
+    return NULL;
+  }
+  h = mmap(NULL, sizeof(struct bwchat_history), PROT_READ | PROT_WRITE,
+           MAP_SHARED, fd, 0);
+  if (h == MAP_FAILED) {
+    syslog(LOG_ERR, "mmap() failure: %s", strerror(errno));
+    close(fd);
+    return NULL;
+  }
+  history_fd = fd;
+  history_shared = 1;
+  return h;
+}
 
-  argp_parse(&argp, argc, argv, 0, 0, 0);
-  signal(SIGPIPE, SIG_IGN);
-  signal(SIGTERM, terminate);
-  signal(SIGINT, terminate);
-  signal(SIGQUIT, terminate);
-  openlog("bwchat-server", LOG_PID | log_stderr, 0);
+/* Marks the beginning of a history update for the readers. */
+void history_update_begin () {
+  history->seq++;
+  __sync_synchronize();
+}
 
-  for (i = 0; i < MESSAGE_COUNT; i++) {
-    messages[i].type = BWC_MESSAGE_NONE;
+/* Marks the end of a history update for the readers. */
+void history_update_end () {
+  __sync_synchronize();
+  history->seq++;
+}
+
+/* Returns the current time in timer ticks. */
+unsigned long ticks_now () {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long)ts.tv_sec * (1000 / TIMER_TICK_MS) +
+    ts.tv_nsec / (TIMER_TICK_MS * 1000000L);
+}
+
+/* Opens the capture file, and writes its header. */
+int capture_open () {
+  capture = fopen(capture_path, "wb");
+  if (capture == NULL) {
+    syslog(LOG_ERR, "Failed to open the capture file: %s", strerror(errno));
+    return -1;
+  }
+  if (fwrite(CAPTURE_MAGIC, CAPTURE_MAGIC_LENGTH, 1, capture) != 1) {
+    syslog(LOG_ERR, "Failed to write into the capture file");
+    return -1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &capture_start);
+  return 0;
+}
+
+/* Records a command read from a client connection into the capture
+   file, if there is one; a zero len records that it is closed. */
+void capture_command (int conn, const char *buf, size_t len) {
+  struct capture_record rec;
+  struct timespec now;
+  const struct bwchat_message *msg;
+  int compact, ok;
+  if (capture == NULL) {
+    return;
+  }
+  msg = NULL;
+  compact = 0;
+  if (len == 1 + sizeof(struct bwchat_message) &&
+      buf[0] == BWC_CMD_ADD_MESSAGE) {
+    msg = (const struct bwchat_message *)(buf + 1);
+    compact = msg->data_len <= BWC_MESSAGE_LENGTH;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  rec.usec = (now.tv_sec - capture_start.tv_sec) * 1000000UL +
+    (now.tv_nsec - capture_start.tv_nsec) / 1000;
+  rec.conn = conn;
+  rec.len = compact ? 1 + BWC_MESSAGE_HEADER_LENGTH +
+    sizeof(msg->data_len) + msg->data_len : len;
+  ok = fwrite(&rec, sizeof(rec), 1, capture) == 1;
+  if (ok && compact) {
+    ok = fwrite(buf, 1 + BWC_MESSAGE_HEADER_LENGTH, 1, capture) == 1 &&
+      fwrite(&(msg->data_len), sizeof(msg->data_len), 1, capture) == 1 &&
+      fwrite(msg->data, 1, msg->data_len, capture) == msg->data_len;
+  } else if (ok) {
+    ok = fwrite(buf, 1, len, capture) == len;
+  }
+  if (! ok) {
+    syslog(LOG_ERR, "Failed to write into the capture file, stopping");
+    fclose(capture);
+    capture = NULL;
+  }
+}
+
+void message_listener_close (struct message_listener *l) {
+  capture_command(l->sock, NULL, 0);
+  close(l->sock);
+  l->sock = -1;
+  timer_cancel(&(l->heartbeat));
+}
+
+void stream_listener_close (struct stream_listener *l) {
+  capture_command(l->sock, NULL, 0);
+  close(l->sock);
+  l->sock = -1;
+  l->msg = NULL;
+}
+
+/* Drops a relay's subscription to an upstream audio stream. */
+void upstream_stream_close (int slot) {
+  if (upstream_streams[slot].sock != -1) {
+    close(upstream_streams[slot].sock);
+    upstream_streams[slot].sock = -1;
   }
+}
+
+/* Sends a message to a message listener, closing the listener on
+   failure. The next heartbeat, if the listener gets them, is
+   scheduled after a period of silence. */
+int message_listener_send (struct message_listener *l,
+                           const void *data, size_t len)
+{
+  if (write(l->sock, data, len) < (ssize_t)len) {
+    message_listener_close(l);
+    return -1;
+  }
+  if (l->heartbeats) {
+    timer_add(&timers, &(l->heartbeat), HEARTBEAT_TICKS);
+  }
+  return 0;
+}
+
+/* A heartbeat timer callback: lets the listener know that the server
+   is alive, and finds out whether the listener is (since a dead one
+   fails to receive it). */
+void heartbeat (struct timer *t) {
+  struct bwchat_message hb;
+  memset(&hb, 0, BWC_HEARTBEAT_LENGTH);
+  time(&(hb.timestamp));
+  hb.type = BWC_MESSAGE_NONE;
+  message_listener_send(t->data, &hb, BWC_HEARTBEAT_LENGTH);
+}
+
+/* Passes audio stream data to the room mixer, if it is enabled. */
+void room_feed (int slot, const char *data, size_t len) {
+#ifdef HAVE_OPUS
+  if (room_mix) {
+    mixer_feed(slot, data, len);
+  }
+#else
+  (void)slot;
+  (void)data;
+  (void)len;
+#endif
+}
+
+/* Lets the room mixer forget an audio stream. */
+void room_stop (int slot) {
+#ifdef HAVE_OPUS
+  if (room_mix) {
+    mixer_stop(slot);
+  }
+#else
+  (void)slot;
+#endif
+}
+
+/* An audio stream timer callback: the stream is considered ended if
+   its speaker has not sent anything for a while, and its listeners
+   are let go. */
+void stream_expire (struct timer *t) {
+  struct bwchat_message *msg = &(history->messages[t - stream_timers]);
+  int i;
+  syslog(LOG_DEBUG, "An audio stream by %s has ended", msg->nick);
   for (i = 0; i < LISTENER_COUNT; i++) {
-    message_listeners[i] = -1;
-    stream_listeners[i].sock = -1;
-    stream_listeners[i].msg = NULL;
+    if (stream_listeners[i].sock != -1 && stream_listeners[i].msg == msg) {
+      stream_listener_close(&(stream_listeners[i]));
+    }
+  }
+  upstream_stream_close(msg - history->messages);
+  room_stop(msg - history->messages);
+  history_update_begin();
+  msg->type = BWC_MESSAGE_AUDIO_ENDED;
+  history_update_end();
+}
+
+/* Sends a packet along with file descriptors. */
+int send_fds (int sock, const void *data, size_t len,
+              const int *fds, unsigned int fd_count)
+{
+  struct msghdr mh;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int) * LISTENER_COUNT)];
+  } control;
+  iov.iov_base = (void *)data;
+  iov.iov_len = len;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = control.buf;
+  mh.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+  cmsg = CMSG_FIRSTHDR(&mh);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+  return sendmsg(sock, &mh, 0) == (ssize_t)len ? 0 : -1;
+}
+
+/* Receives a packet along with file descriptors, returns the packet
+   length, or -1 on failure. */
+ssize_t recv_fds (int sock, void *data, size_t len,
+                  int *fds, unsigned int *fd_count)
+{
+  struct msghdr mh;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int) * LISTENER_COUNT)];
+  } control;
+  ssize_t ret;
+  iov.iov_base = data;
+  iov.iov_len = len;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = control.buf;
+  mh.msg_controllen = sizeof(control.buf);
+  ret = recvmsg(sock, &mh, 0);
+  *fd_count = 0;
+  if (ret < 0 || (mh.msg_flags & MSG_CTRUNC)) {
+    return -1;
   }
+  for (cmsg = CMSG_FIRSTHDR(&mh); cmsg != NULL; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      *fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * *fd_count);
+    }
+  }
+  return ret;
+}
+
+/* Connects to a server socket. */
+int sock_connect (const char *path) {
+  struct sockaddr_un addr;
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if (sock < 0) {
+    syslog(LOG_ERR, "socket() failure: %s", strerror(errno));
+    return -1;
+  }
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path));
+  addr.sun_path[sizeof(addr.sun_path) - 1] = '\0';
+  if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    syslog(LOG_ERR, "connect() failure: %s", strerror(errno));
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+/* Creates, binds, and starts listening on the server socket. */
+int listen_socket () {
+  struct sockaddr_un server_addr;
+  socklen_t server_addr_size;
 
   /* Create the socket. */
   server_sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
@@ -131,161 +620,1023 @@ int main (int argc, char **argv) {
     syslog(LOG_ERR, "listen() failure: %s", strerror(errno));
     return -1;
   }
-  while (1) {
-    client_sock = accept(server_sock,
-                         (struct sockaddr *)&client_addr,
-                         &client_addr_size);
-    if (client_sock < 0) {
-      syslog(LOG_ERR, "accept() failure: %s", strerror(errno));
-      close(server_sock);
-      client_sock = -1;
+  return 0;
+}
+
+/*
+  https://www.xiph.org/ogg/doc/framing.html -- Ogg
+  https://www.rfc-editor.org/rfc/rfc7845#section-5 -- Opus
+*/
+
+/* Archive records are messages without the unused part of their data
+   buffers: BWC_MESSAGE_HEADER_LENGTH bytes of a message header,
+   followed by data_len, and data_len bytes of data. Only text
+   messages and uploads are archived. */
+
+/* Indexes an archived message: its nick, and either its text or the
+   displayed name of an upload. */
+int archive_index_add (unsigned long id, const struct bwchat_message *msg) {
+  const char *text = msg->data;
+  size_t len = msg->data_len, stored_len;
+  if (msg->type == BWC_MESSAGE_UPLOAD) {
+    stored_len = strnlen(msg->data, msg->data_len);
+    if (stored_len < msg->data_len) {
+      text += stored_len + 1;
+      len -= stored_len + 1;
+    }
+  }
+  return search_index_add(&archive_index, id, msg->nick,
+                          strnlen(msg->nick, BWC_NICK_LENGTH)) ||
+    search_index_add(&archive_index, id, text, strnlen(text, len));
+}
+
+/* Records the offset of a new archive record, and indexes it. */
+int archive_record_add (off_t offset, const struct bwchat_message *msg) {
+  if (archive_count == archive_size) {
+    unsigned long new_size = archive_size ? archive_size * 2 : 1024;
+    off_t *offsets = realloc(archive_offsets, new_size * sizeof(off_t));
+    if (offsets == NULL) {
+      syslog(LOG_ERR, "Failed to allocate archive offsets");
+      return -1;
+    }
+    archive_offsets = offsets;
+    archive_size = new_size;
+  }
+  archive_offsets[archive_count] = offset;
+  if (archive_index_add(archive_count, msg) != 0) {
+    syslog(LOG_ERR, "Failed to index an archived message");
+    return -1;
+  }
+  archive_count++;
+  return 0;
+}
+
+/* Opens the archive. */
+int archive_open () {
+  archive_fd = open(archive_path, O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (archive_fd < 0) {
+    syslog(LOG_ERR, "Failed to open the archive: %s", strerror(errno));
+    return -1;
+  }
+  if (search_index_init(&archive_index) != 0) {
+    syslog(LOG_ERR, "Failed to allocate the search index");
+    return -1;
+  }
+  return 0;
+}
+
+/* Indexes the archived messages, once no other server appends to the
+   archive. A partially written record at the end (left by a crash)
+   is truncated. */
+int archive_scan () {
+  static struct bwchat_message msg;
+  ssize_t len;
+  if (lseek(archive_fd, archive_end, SEEK_SET) < 0) {
+    syslog(LOG_ERR, "lseek() failure: %s", strerror(errno));
+    return -1;
+  }
+  while ((len = read(archive_fd, &msg, BWC_MESSAGE_HEADER_LENGTH)) ==
+         (ssize_t)BWC_MESSAGE_HEADER_LENGTH) {
+    if (read(archive_fd, &(msg.data_len), sizeof(msg.data_len)) !=
+        sizeof(msg.data_len) || msg.data_len > BWC_MESSAGE_LENGTH ||
+        read(archive_fd, msg.data, msg.data_len) != (ssize_t)msg.data_len) {
+      break;
+    }
+    if (archive_record_add(archive_end, &msg) != 0) {
       return -1;
     }
+    archive_end += BWC_MESSAGE_HEADER_LENGTH + sizeof(msg.data_len) +
+      msg.data_len;
+  }
+  if (lseek(archive_fd, 0, SEEK_CUR) != archive_end) {
+    syslog(LOG_WARNING, "Truncating a partial archive record");
+    if (ftruncate(archive_fd, archive_end) < 0) {
+      syslog(LOG_ERR, "ftruncate() failure: %s", strerror(errno));
+      return -1;
+    }
+  }
+  syslog(LOG_INFO, "Indexed %lu archived messages", archive_count);
+  return 0;
+}
 
-    len = read(client_sock, buf, sizeof(buf));
-    if (len <= 0) {
-      if (len == 0) {
-        syslog(LOG_WARNING,
-               "The client disconnected without issuing a command");
-      } else {
-        syslog(LOG_ERR, "read() failure: %s", strerror(errno));
-      }
-      close(client_sock);
-      client_sock = -1;
-      continue;
-    }
-
-    if (buf[0] == BWC_CMD_ADD_MESSAGE &&
-        len == sizeof(struct bwchat_message) + 1) {
-      struct bwchat_message *src_msg = (struct bwchat_message *)(buf + 1);
-      struct bwchat_message *upd_msg = NULL;
-      int new_message = src_msg->type == BWC_MESSAGE_TEXT ||
-        src_msg->type == BWC_MESSAGE_UPLOAD;
-      if (src_msg->type == BWC_MESSAGE_AUDIO) {
-        if (src_msg->data[5] & 0x02) {
-          /* The beginning of a stream: this is going to be a new
-             message if there is no stream with the same nick;
-             otherwise updating that one. */
-          new_message = 1;
-        }
-        for (i = 0; i < MESSAGE_COUNT; i++) {
-          if (messages[i].type == BWC_MESSAGE_AUDIO &&
-              strcmp(messages[i].nick, src_msg->nick) == 0) {
-            new_message = 0;
-            upd_msg = &(messages[i]);
-            break;
-          }
+/* Appends a message to the archive, if there is one. */
+void archive_add (const struct bwchat_message *msg) {
+  struct iovec iov[3];
+  ssize_t len =
+    BWC_MESSAGE_HEADER_LENGTH + sizeof(msg->data_len) + msg->data_len;
+  off_t offset;
+  if (archive_fd == -1) {
+    return;
+  }
+  /* Where the record goes, regardless of what is known about the
+     archive's end */
+  offset = lseek(archive_fd, 0, SEEK_END);
+  if (offset < 0) {
+    syslog(LOG_ERR, "lseek() failure: %s", strerror(errno));
+    return;
+  }
+  iov[0].iov_base = (void *)msg;
+  iov[0].iov_len = BWC_MESSAGE_HEADER_LENGTH;
+  iov[1].iov_base = (void *)&(msg->data_len);
+  iov[1].iov_len = sizeof(msg->data_len);
+  iov[2].iov_base = (void *)msg->data;
+  iov[2].iov_len = msg->data_len;
+  if (writev(archive_fd, iov, 3) != len) {
+    syslog(LOG_ERR, "Failed to archive a message: %s", strerror(errno));
+    if (ftruncate(archive_fd, offset) < 0) {
+      syslog(LOG_ERR, "ftruncate() failure: %s", strerror(errno));
+    }
+    return;
+  }
+  archive_end = offset + len;
+  archive_record_add(offset, msg);
+}
+
+/* Sends archived messages matching a query to a client, the most
+   recent ones first. */
+int send_search_results (int sock, const char *query) {
+  static struct bwchat_message msg;
+  unsigned long ids[BWC_SEARCH_RESULTS];
+  size_t found, i;
+  off_t offset;
+  if (archive_fd == -1) {
+    return 0;
+  }
+  found = search_index_query(&archive_index, query, ids, BWC_SEARCH_RESULTS);
+  for (i = 0; i < found; i++) {
+    offset = archive_offsets[ids[i]];
+    if (pread(archive_fd, &msg, BWC_MESSAGE_HEADER_LENGTH, offset) !=
+        (ssize_t)BWC_MESSAGE_HEADER_LENGTH ||
+        pread(archive_fd, &(msg.data_len), sizeof(msg.data_len),
+              offset + BWC_MESSAGE_HEADER_LENGTH) != sizeof(msg.data_len) ||
+        msg.data_len > BWC_MESSAGE_LENGTH ||
+        pread(archive_fd, msg.data, msg.data_len,
+              offset + BWC_MESSAGE_HEADER_LENGTH + sizeof(msg.data_len)) !=
+        (ssize_t)msg.data_len) {
+      syslog(LOG_ERR, "Failed to read an archived message");
+      return -1;
+    }
+    memset(msg.data + msg.data_len, 0, BWC_MESSAGE_LENGTH - msg.data_len);
+    if (write(sock, &msg, sizeof(msg)) < (ssize_t)sizeof(msg)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Finds an ongoing audio stream by nick. */
+struct bwchat_message *stream_find (const char *nick) {
+  int i;
+  for (i = 0; i < MESSAGE_COUNT; i++) {
+    if (history->messages[i].type == BWC_MESSAGE_AUDIO &&
+        strcmp(history->messages[i].nick, nick) == 0) {
+      return &(history->messages[i]);
+    }
+  }
+  return NULL;
+}
+
+/* Finds the most recent ended audio stream by a nick. */
+struct bwchat_message *stream_find_ended (const char *nick) {
+  struct bwchat_message *msg;
+  int i;
+  for (i = MESSAGE_COUNT; i > 0; i--) {
+    msg = &(history->messages[(history->oldest + i - 1) % MESSAGE_COUNT]);
+    if (msg->type == BWC_MESSAGE_AUDIO_ENDED &&
+        strcmp(msg->nick, nick) == 0) {
+      return msg;
+    }
+  }
+  return NULL;
+}
+
+/* Writes queued audio chunks to stream listeners, until about budget
+   bytes are written, or the queue is empty. */
+void audio_fanout (size_t budget) {
+  struct audio_job *job;
+  size_t written = 0;
+  int sent = 0;
+  PROBE2(fanout__start, BWC_MESSAGE_AUDIO, audio_count);
+  while (audio_count > 0 && written < budget) {
+    job = &(audio_queue[audio_first]);
+    for (; job->msg != NULL && job->listener < LISTENER_COUNT &&
+           written < budget; job->listener++) {
+      struct stream_listener *l = &(stream_listeners[job->listener]);
+      if (l->msg == job->msg && l->sock != -1) {
+        /* A listener that does not keep up misses the chunk,
+           rather than stalling the others. */
+        if (write(l->sock, job->data, job->len) == (ssize_t)job->len) {
+          sent++;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          stream_listener_close(l);
         }
+        written += job->len;
       }
-      if (new_message) {
-        /* A new message */
-        struct bwchat_message *dst_msg = &(messages[oldest_message]);
-        if (dst_msg->type == BWC_MESSAGE_AUDIO) {
-          /* Close sockets for audio listeners. */
-          for (i = 0; i < LISTENER_COUNT; i++) {
-            if (stream_listeners[i].msg == dst_msg) {
-              close(stream_listeners[i].sock);
-              stream_listeners[i].sock = -1;
-              stream_listeners[i].msg = NULL;
-            }
-          }
-        }
-        oldest_message = (oldest_message + 1) % MESSAGE_COUNT;
-        memcpy(dst_msg, src_msg, sizeof(struct bwchat_message));
-        /* Send the new message to message listeners */
-        for (i = 0; i < LISTENER_COUNT; i++) {
-          if (message_listeners[i] != -1) {
-            len = write(message_listeners[i], dst_msg,
-                        sizeof(struct bwchat_message));
-            if (len < (ssize_t)sizeof(struct bwchat_message)) {
-              close(message_listeners[i]);
-              message_listeners[i] = -1;
-            }
-          }
-        }
-      } else if (upd_msg != NULL) {
-        if (src_msg->data[5] & 0x02) {
-          /* A header page, replace the data. */
-          memcpy(upd_msg->data, src_msg->data, src_msg->data_len);
-          upd_msg->data_len = src_msg->data_len;
-        }
-        /* Send the new data to stream listeners */
-        for (i = 0; i < LISTENER_COUNT; i++) {
-          if (stream_listeners[i].msg == upd_msg &&
-              stream_listeners[i].sock != -1) {
-            len = write(stream_listeners[i].sock,
-                        src_msg->data,
-                        src_msg->data_len);
-            if (len < (ssize_t)(src_msg->data_len)) {
-              close(stream_listeners[i].sock);
-              stream_listeners[i].sock = -1;
-              stream_listeners[i].msg = NULL;
-            }
-          }
-        }
+    }
+    if (job->msg == NULL || job->listener == LISTENER_COUNT) {
+      audio_first = (audio_first + 1) % AUDIO_QUEUE_LENGTH;
+      audio_count--;
+    }
+  }
+  PROBE1(fanout__done, sent);
+}
+
+/* Queues an audio chunk for a stream's listeners. */
+void audio_queue_add (struct bwchat_message *msg, const char *data,
+                      size_t len)
+{
+  struct audio_job *job;
+  if (audio_count == AUDIO_QUEUE_LENGTH) {
+    /* Listeners do not keep up: catch up, without a budget. */
+    audio_fanout((size_t)-1);
+  }
+  job = &(audio_queue[(audio_first + audio_count) % AUDIO_QUEUE_LENGTH]);
+  job->msg = msg;
+  job->listener = 0;
+  job->len = len;
+  memcpy(job->data, data, len);
+  audio_count++;
+}
+
+/* Cancels queued chunks of a stream, once its message is replaced. */
+void audio_queue_drop (const struct bwchat_message *msg) {
+  unsigned int i;
+  for (i = 0; i < audio_count; i++) {
+    struct audio_job *job = &(audio_queue[(audio_first + i) %
+                                          AUDIO_QUEUE_LENGTH]);
+    if (job->msg == msg) {
+      job->msg = NULL;
+    }
+  }
+}
+
+/* Puts a message into the history, in place of the oldest one, and
+   sends it to message listeners. */
+struct bwchat_message *message_append (const struct bwchat_message *src) {
+  struct bwchat_message *dst = &(history->messages[history->oldest]);
+  int i, sent;
+  if (dst->type == BWC_MESSAGE_AUDIO) {
+    /* Close sockets for audio listeners. */
+    for (i = 0; i < LISTENER_COUNT; i++) {
+      if (stream_listeners[i].msg == dst) {
+        stream_listener_close(&(stream_listeners[i]));
       }
-      close(client_sock);
-      client_sock = -1;
-    } else if (buf[0] == BWC_CMD_ALL_MESSAGES) {
-      for (i = 0; i < MESSAGE_COUNT; i++) {
-        struct bwchat_message *msg =
-          &(messages[(oldest_message + i) % MESSAGE_COUNT]);
-        if (msg->type != BWC_MESSAGE_NONE) {
-          len = write(client_sock, msg, sizeof(*msg));
-          if (len < (ssize_t)sizeof(*msg)) {
-            break;
-          }
-        }
+    }
+  }
+  audio_queue_drop(dst);
+  timer_cancel(&(stream_timers[history->oldest]));
+  upstream_stream_close(history->oldest);
+  room_stop(history->oldest);
+  PROBE2(history__copy__start, src->type, src->data_len);
+  history_update_begin();
+  history->oldest = (history->oldest + 1) % MESSAGE_COUNT;
+  memcpy(dst, src, sizeof(struct bwchat_message));
+  history_update_end();
+  PROBE(history__copy__done);
+  if (dst->type == BWC_MESSAGE_AUDIO) {
+    timer_add(&timers, &(stream_timers[dst - history->messages]),
+              STREAM_TIMEOUT_TICKS);
+    room_feed(dst - history->messages, dst->data, dst->data_len);
+  }
+  /* Send the new message to message listeners */
+  PROBE2(fanout__start, dst->type, sizeof(struct bwchat_message));
+  for (i = 0, sent = 0; i < LISTENER_COUNT; i++) {
+    if (message_listeners[i].sock != -1 &&
+        message_listener_send(&(message_listeners[i]), dst,
+                              sizeof(struct bwchat_message)) == 0) {
+      sent++;
+    }
+  }
+  PROBE1(fanout__done, sent);
+  return dst;
+}
+
+/* Queues new data of an audio stream for its listeners. A header page
+   replaces the data stored in the message, to be sent to listeners
+   joining later. */
+void stream_update (struct bwchat_message *msg, const char *data,
+                    size_t len)
+{
+  if (len > 5 && (data[5] & 0x02)) {
+    PROBE2(history__copy__start, msg->type, len);
+    history_update_begin();
+    memcpy(msg->data, data, len);
+    msg->data_len = len;
+    history_update_end();
+    PROBE(history__copy__done);
+  }
+  audio_queue_add(msg, data, len);
+  room_feed(msg - history->messages, data, len);
+  /* Postpone the stream's expiration. */
+  timer_add(&timers, &(stream_timers[msg - history->messages]),
+            STREAM_TIMEOUT_TICKS);
+}
+
+/* Processes a new message, or a chunk of an audio stream. */
+void add_message (const struct bwchat_message *src) {
+  struct bwchat_message *msg;
+  if (src->data_len > BWC_MESSAGE_LENGTH) {
+    syslog(LOG_WARNING, "Ignoring a message with invalid length");
+  } else if (src->type == BWC_MESSAGE_TEXT ||
+             src->type == BWC_MESSAGE_UPLOAD) {
+    message_append(src);
+    archive_add(src);
+  } else if (src->type == BWC_MESSAGE_AUDIO) {
+    msg = stream_find(src->nick);
+    if (msg != NULL) {
+      stream_update(msg, src->data, src->data_len);
+    } else if (src->data[5] & 0x02) {
+      /* The beginning of a stream, and there is no stream with the
+         same nick yet. */
+      message_append(src);
+    } else if ((msg = stream_find_ended(src->nick)) != NULL) {
+      /* The speaker resumes after a stall: the stream goes on, with
+         the header it began with. */
+      syslog(LOG_DEBUG, "An audio stream by %s is resumed", src->nick);
+      history_update_begin();
+      msg->type = BWC_MESSAGE_AUDIO;
+      history_update_end();
+      room_feed(msg - history->messages, msg->data, msg->data_len);
+      stream_update(msg, src->data, src->data_len);
+    } else {
+      syslog(LOG_WARNING, "Dropping an audio chunk by %s: no stream",
+             src->nick);
+    }
+  }
+}
+
+/* Sends all the messages to a client. */
+int send_messages (int sock) {
+  int i, sent = 0;
+  PROBE1(dump__start, sock);
+  for (i = 0; i < MESSAGE_COUNT; i++) {
+    struct bwchat_message *msg =
+      &(history->messages[(history->oldest + i) % MESSAGE_COUNT]);
+    if (msg->type != BWC_MESSAGE_NONE) {
+      if (write(sock, msg, sizeof(*msg)) < (ssize_t)sizeof(*msg)) {
+        PROBE2(dump__done, sent, -1);
+        return -1;
       }
-      close(client_sock);
-      client_sock = -1;
-    } else if (buf[0] == BWC_CMD_NEW_MESSAGES) {
-      for (i = 0; i < LISTENER_COUNT; i++) {
-        if (message_listeners[i] == -1) {
-          message_listeners[i] = client_sock;
-          break;
-        }
+      sent++;
+    }
+  }
+  PROBE2(dump__done, sent, 0);
+  return 0;
+}
+
+/* Queues a client for a history dump, or sends it at once if the
+   queue is full. Returns 0 if the client is queued. */
+int dump_queue_add (int sock) {
+  if (dump_count == DUMP_QUEUE_LENGTH) {
+    send_messages(sock);
+    return -1;
+  }
+  dump_queue[(dump_first + dump_count) % DUMP_QUEUE_LENGTH] = sock;
+  dump_count++;
+  return 0;
+}
+
+/* Sends the history to the next queued client, and disconnects it. */
+void dump_next () {
+  int sock = dump_queue[dump_first];
+  dump_first = (dump_first + 1) % DUMP_QUEUE_LENGTH;
+  dump_count--;
+  send_messages(sock);
+  close(sock);
+}
+
+int message_listener_add (int sock, int heartbeats) {
+  int i;
+  for (i = 0; i < LISTENER_COUNT; i++) {
+    if (message_listeners[i].sock == -1) {
+      message_listeners[i].sock = sock;
+      message_listeners[i].heartbeats = heartbeats;
+      if (heartbeats) {
+        timer_add(&timers, &(message_listeners[i].heartbeat),
+                  HEARTBEAT_TICKS);
       }
-      if (i == LISTENER_COUNT) {
-        close(client_sock);
-        client_sock = -1;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/* Makes a stream listener's socket non-blocking, so that writes to a
+   slow listener do not stall the rest. */
+int stream_listener_nonblock (int sock) {
+  if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) < 0) {
+    syslog(LOG_ERR, "fcntl() failure: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/* Makes a client a listener of an audio stream (or of the room mix),
+   sending it the stream's header at once. */
+int stream_listener_attach (int sock, struct bwchat_message *msg) {
+  int i;
+  for (i = 0; i < LISTENER_COUNT; i++) {
+    if (stream_listeners[i].sock == -1) {
+      stream_listeners[i].sock = sock;
+      stream_listeners[i].msg = msg;
+      if (stream_listener_nonblock(sock) < 0 ||
+          write(sock, msg->data, msg->data_len) < (ssize_t)(msg->data_len)) {
+        stream_listener_close(&(stream_listeners[i]));
+      }
+      return 0;
+    }
+  }
+  return -1;
+}
+
+int stream_listener_add (int sock, const char *nick) {
+  struct bwchat_message *msg = stream_find(nick);
+  if (msg == NULL) {
+    return -1;
+  }
+  return stream_listener_attach(sock, msg);
+}
+
+#ifdef HAVE_OPUS
+/* The room mix timer callback: mixes another tick of the audio
+   streams, and queues it for room listeners. The streams are mixed
+   (and consumed) even without listeners, so that they do not lag
+   behind once a listener joins. */
+void room_tick (struct timer *t) {
+  static char page[BWC_MESSAGE_LENGTH];
+  size_t len;
+  int i;
+  for (i = 0; i < LISTENER_COUNT; i++) {
+    if (stream_listeners[i].sock != -1 && stream_listeners[i].msg == &room) {
+      break;
+    }
+  }
+  len = mixer_mix(i < LISTENER_COUNT ? page : NULL, sizeof(page),
+                  ROOM_FRAMES);
+  if (len > 0) {
+    audio_queue_add(&room, page, len);
+  }
+  timer_add(&timers, t, 1);
+}
+#endif
+
+int room_listener_add (int sock) {
+#ifdef HAVE_OPUS
+  if (room_mix) {
+    return stream_listener_attach(sock, &room);
+  }
+#else
+  (void)sock;
+#endif
+  return -1;
+}
+
+/* Subscribes a relay to an upstream audio stream, unless it is
+   already subscribed. */
+void upstream_stream_open (struct bwchat_message *msg) {
+  int slot = msg - history->messages;
+  char cmd[BWC_NICK_LENGTH + 1];
+  if (upstream_streams[slot].sock != -1) {
+    return;
+  }
+  upstream_streams[slot].sock = sock_connect(upstream_path);
+  if (upstream_streams[slot].sock < 0) {
+    return;
+  }
+  cmd[0] = BWC_CMD_AUDIO_STREAM;
+  strncpy(cmd + 1, msg->nick, BWC_NICK_LENGTH);
+  if (write(upstream_streams[slot].sock, cmd, sizeof(cmd)) != sizeof(cmd)) {
+    upstream_stream_close(slot);
+  }
+}
+
+/* Receives a chunk of an upstream audio stream, or its end. */
+void upstream_stream_receive (int slot) {
+  static char buf[BWC_MESSAGE_LENGTH];
+  struct bwchat_message *msg = &(history->messages[slot]);
+  ssize_t len = read(upstream_streams[slot].sock, buf, sizeof(buf));
+  if (len <= 0) {
+    /* The stream has ended upstream */
+    upstream_stream_close(slot);
+    if (msg->type == BWC_MESSAGE_AUDIO) {
+      timer_cancel(&(stream_timers[slot]));
+      stream_expire(&(stream_timers[slot]));
+    }
+  } else if ((size_t)len != msg->data_len ||
+             memcmp(buf, msg->data, len) != 0) {
+    /* Skipping the header sent upon subscription, if it is already
+       known. */
+    stream_update(msg, buf, len);
+  }
+}
+
+/* Receives a message replicated from upstream: either a new one, or
+   an existing one during the initial synchronization. */
+void upstream_receive () {
+  static struct bwchat_message msg;
+  struct bwchat_message *dst;
+  ssize_t len = read(upstream_sock, &msg, sizeof(msg));
+  if (len >= (ssize_t)BWC_HEARTBEAT_LENGTH && msg.type == BWC_MESSAGE_NONE) {
+    /* A heartbeat */
+    return;
+  }
+  if (len != sizeof(msg)) {
+    syslog(LOG_ERR, "The upstream server is gone");
+    cleanup();
+    exit(1);
+  }
+  if (msg.type == BWC_MESSAGE_AUDIO) {
+    add_message(&msg);
+    dst = stream_find(msg.nick);
+    if (dst != NULL) {
+      upstream_stream_open(dst);
+    }
+  } else if (msg.data_len <= BWC_MESSAGE_LENGTH) {
+    message_append(&msg);
+  }
+}
+
+/* Connects a relay to its upstream, requesting replication. */
+int upstream_connect () {
+  char c = BWC_CMD_REPLICATE;
+  upstream_sock = sock_connect(upstream_path);
+  if (upstream_sock < 0) {
+    return -1;
+  }
+  if (write(upstream_sock, &c, 1) != 1) {
+    syslog(LOG_ERR, "Failed to request replication: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/* Forwards a command to a relay's upstream, and waits for it to be
+   processed there. Since the resulting message gets replicated before
+   the upstream closes the connection, it is applied here before the
+   client is let go, as if the relay processed it itself. */
+void upstream_forward (const char *buf, size_t len) {
+  struct pollfd pfd;
+  char c;
+  int sock = sock_connect(upstream_path);
+  if (sock < 0) {
+    return;
+  }
+  if (write(sock, buf, len) != (ssize_t)len) {
+    syslog(LOG_ERR, "Failed to forward a message: %s", strerror(errno));
+  } else {
+    while (read(sock, &c, 1) > 0);
+  }
+  close(sock);
+  pfd.fd = upstream_sock;
+  pfd.events = POLLIN;
+  while (poll(&pfd, 1, 0) == 1) {
+    upstream_receive();
+  }
+}
+
+/* Tells whether a stream listener is to be handed over: room mix
+   listeners are not, since the mix starts anew in a new process. */
+int stream_listener_handed (const struct stream_listener *l) {
+#ifdef HAVE_OPUS
+  if (l->msg == &room) {
+    return 0;
+  }
+#endif
+  return l->sock != -1;
+}
+
+/* Hands the listening socket, listeners, and history over to a new
+   server process connected via client_sock, returns 0 once the new
+   process has confirmed it, and the caller is to exit then.
+   The socket path and shared memory are left in place, since they
+   are taken over as well. */
+int handover () {
+  struct ucred cred;
+  socklen_t cred_len = sizeof(cred);
+  struct handover_header hdr;
+  struct timeval timeout;
+  int fds[LISTENER_COUNT], indices[LISTENER_COUNT];
+  int i;
+  char c;
+
+  if (getsockopt(client_sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0 ||
+      (cred.uid != getuid() && cred.uid != 0)) {
+    syslog(LOG_WARNING, "Refusing a handover to another user");
+    return -1;
+  }
+  syslog(LOG_INFO, "Handing over to process %d", (int)cred.pid);
+  timeout.tv_sec = HANDOVER_TIMEOUT;
+  timeout.tv_usec = 0;
+  if (setsockopt(client_sock, SOL_SOCKET, SO_RCVTIMEO,
+                 &timeout, sizeof(timeout)) < 0 ||
+      setsockopt(client_sock, SOL_SOCKET, SO_SNDTIMEO,
+                 &timeout, sizeof(timeout)) < 0) {
+    syslog(LOG_ERR, "setsockopt() failure: %s", strerror(errno));
+    return -1;
+  }
+  /* Complete the queued work, since it is not handed over. */
+  audio_fanout((size_t)-1);
+  while (dump_count > 0) {
+    dump_next();
+  }
+
+  hdr.oldest = history->oldest;
+  hdr.message_listener_count = 0;
+  hdr.stream_listener_count = 0;
+  for (i = 0; i < LISTENER_COUNT; i++) {
+    if (message_listeners[i].sock != -1) {
+      hdr.message_listener_count++;
+    }
+    if (stream_listener_handed(&(stream_listeners[i]))) {
+      hdr.stream_listener_count++;
+    }
+  }
+  fds[0] = server_sock;
+  fds[1] = history_fd;
+  if (send_fds(client_sock, &hdr, sizeof(hdr), fds, history_shared ? 2 : 1)
+      < 0) {
+    syslog(LOG_ERR, "Failed to send the listening socket: %s",
+           strerror(errno));
+    return -1;
+  }
+  for (i = 0; i < MESSAGE_COUNT; i++) {
+    if (write(client_sock, &(history->messages[i]),
+              sizeof(struct bwchat_message))
+        != sizeof(struct bwchat_message)) {
+      syslog(LOG_ERR, "Failed to send the history: %s", strerror(errno));
+      return -1;
+    }
+  }
+  if (hdr.message_listener_count > 0) {
+    unsigned int n = 0;
+    for (i = 0; i < LISTENER_COUNT; i++) {
+      if (message_listeners[i].sock != -1) {
+        fds[n] = message_listeners[i].sock;
+        indices[n] = message_listeners[i].heartbeats;
+        n++;
+      }
+    }
+    if (send_fds(client_sock, indices, sizeof(int) * n, fds, n) < 0) {
+      syslog(LOG_ERR, "Failed to send message listeners: %s",
+             strerror(errno));
+      return -1;
+    }
+  }
+  if (hdr.stream_listener_count > 0) {
+    unsigned int n = 0;
+    for (i = 0; i < LISTENER_COUNT; i++) {
+      if (stream_listener_handed(&(stream_listeners[i]))) {
+        fds[n] = stream_listeners[i].sock;
+        indices[n] = stream_listeners[i].msg - history->messages;
+        n++;
+      }
+    }
+    if (send_fds(client_sock, indices, sizeof(int) * n, fds, n) < 0) {
+      syslog(LOG_ERR, "Failed to send stream listeners: %s",
+             strerror(errno));
+      return -1;
+    }
+  }
+  /* Keep serving until the new server has got it all, and only exit
+     once that is confirmed, so that exactly one of them goes on. */
+  if (read(client_sock, &c, 1) != 1) {
+    syslog(LOG_ERR, "The handover is not acknowledged, continuing");
+    return -1;
+  }
+  if (write(client_sock, &c, 1) != 1) {
+    syslog(LOG_ERR, "Failed to confirm the handover: %s", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/* Takes over the listening socket, listeners, and history from a
+   running server. The running server keeps going if this fails. */
+int take_over_state () {
+  struct handover_header hdr;
+  int sock, fds[LISTENER_COUNT], indices[LISTENER_COUNT];
+  unsigned int i, fd_count = 0;
+  int created = 0;
+  char c = BWC_CMD_HANDOVER;
+
+  sock = sock_connect(sock_path);
+  if (sock < 0) {
+    return -1;
+  }
+  if (write(sock, &c, 1) != 1 ||
+      recv_fds(sock, &hdr, sizeof(hdr), fds, &fd_count) != sizeof(hdr) ||
+      fd_count < 1 || fd_count > 2) {
+    syslog(LOG_ERR, "Failed to receive the listening socket");
+    for (i = 0; i < fd_count; i++) {
+      close(fds[i]);
+    }
+    close(sock);
+    return -1;
+  }
+  server_sock = fds[0];
+  /* Readers keep using the shared history, if there is one. */
+  if (fd_count == 2) {
+    history = history_attach(fds[1]);
+  } else {
+    history = history_map();
+    if (history != NULL) {
+      history->seq = 0;
+      created = history_shared;
+    }
+  }
+  if (history == NULL) {
+    syslog(LOG_ERR, "Failed to set up the message history");
+    close(sock);
+    return -1;
+  }
+
+  history_update_begin();
+  history->oldest = hdr.oldest % MESSAGE_COUNT;
+  for (i = 0; i < MESSAGE_COUNT; i++) {
+    if (read(sock, &(history->messages[i]), sizeof(struct bwchat_message))
+        != sizeof(struct bwchat_message)) {
+      history->messages[i].type = BWC_MESSAGE_NONE;
+      syslog(LOG_ERR, "Failed to receive the history");
+      break;
+    }
+    if (history->messages[i].type == BWC_MESSAGE_AUDIO) {
+      timer_add(&timers, &(stream_timers[i]), STREAM_TIMEOUT_TICKS);
+      room_feed(i, history->messages[i].data, history->messages[i].data_len);
+    }
+  }
+  history_update_end();
+
+  if (hdr.message_listener_count > 0) {
+    if (recv_fds(sock, indices, sizeof(indices), fds, &fd_count) < 0) {
+      syslog(LOG_ERR, "Failed to receive message listeners");
+      fd_count = 0;
+    }
+    for (i = 0; i < fd_count; i++) {
+      message_listeners[i].sock = fds[i];
+      message_listeners[i].heartbeats = indices[i];
+      if (indices[i]) {
+        timer_add(&timers, &(message_listeners[i].heartbeat),
+                  HEARTBEAT_TICKS);
       }
-    } else if (buf[0] == BWC_CMD_AUDIO_STREAM) {
-      struct bwchat_message *msg = NULL;
-      buf[BWC_NICK_LENGTH + 1] = '\0';
+    }
+  }
+  if (hdr.stream_listener_count > 0) {
+    if (recv_fds(sock, indices, sizeof(indices), fds, &fd_count) < 0) {
+      syslog(LOG_ERR, "Failed to receive stream listeners");
+      fd_count = 0;
+    }
+    for (i = 0; i < fd_count; i++) {
+      if (indices[i] < 0 || indices[i] >= MESSAGE_COUNT ||
+          stream_listener_nonblock(fds[i]) < 0) {
+        close(fds[i]);
+        continue;
+      }
+      stream_listeners[i].sock = fds[i];
+      stream_listeners[i].msg = &(history->messages[indices[i]]);
+    }
+  }
+  if (write(sock, &c, 1) != 1 || read(sock, &c, 1) != 1) {
+    syslog(LOG_ERR, "The handover is not confirmed");
+    if (created) {
+      shm_unlink(shm_name);
+    }
+    close(sock);
+    return -1;
+  }
+  close(sock);
+  syslog(LOG_INFO, "Took over the state");
+  return 0;
+}
+
+/* Passes a query to a relay's upstream, and its results back to the
+   client. */
+void upstream_proxy (const char *buf, size_t len) {
+  static struct bwchat_message msg;
+  ssize_t rlen;
+  int sock = sock_connect(upstream_path);
+  if (sock < 0) {
+    return;
+  }
+  if (write(sock, buf, len) != (ssize_t)len) {
+    syslog(LOG_ERR, "Failed to forward a query: %s", strerror(errno));
+  } else {
+    while ((rlen = read(sock, &msg, sizeof(msg))) > 0 &&
+           write(client_sock, &msg, rlen) == rlen);
+  }
+  close(sock);
+}
+
+/* Reads and processes a command from client_sock, closing it unless
+   the client becomes a listener. */
+void handle_client () {
+  /* One extra byte to terminate a search query with */
+  static char buf[2 + sizeof(struct bwchat_message)];
+  ssize_t len = read(client_sock, buf, sizeof(buf) - 1);
+  int keep = 0;
+  PROBE2(command__start, len > 0 ? buf[0] : -1, len);
+  if (len > 0) {
+    capture_command(client_sock, buf, len);
+  }
+  if (len <= 0) {
+    if (len == 0) {
+      syslog(LOG_WARNING,
+             "The client disconnected without issuing a command");
+    } else {
+      syslog(LOG_ERR, "read() failure: %s", strerror(errno));
+    }
+  } else if (buf[0] == BWC_CMD_ADD_MESSAGE &&
+             len == sizeof(struct bwchat_message) + 1) {
+    if (upstream_path != NULL) {
+      upstream_forward(buf, len);
+    } else {
+      add_message((struct bwchat_message *)(buf + 1));
+    }
+  } else if (buf[0] == BWC_CMD_ALL_MESSAGES) {
+    keep = dump_queue_add(client_sock) == 0;
+  } else if (buf[0] == BWC_CMD_NEW_MESSAGES) {
+    keep = message_listener_add(client_sock, 0) == 0;
+  } else if (buf[0] == BWC_CMD_NEW_MESSAGES_HEARTBEAT) {
+    keep = message_listener_add(client_sock, 1) == 0;
+  } else if (buf[0] == BWC_CMD_REPLICATE) {
+    keep = send_messages(client_sock) == 0 &&
+      message_listener_add(client_sock, 1) == 0;
+  } else if (buf[0] == BWC_CMD_AUDIO_STREAM) {
+    buf[BWC_NICK_LENGTH + 1] = '\0';
+    keep = stream_listener_add(client_sock, buf + 1) == 0;
+  } else if (buf[0] == BWC_CMD_ROOM_STREAM) {
+    keep = room_listener_add(client_sock) == 0;
+  } else if (buf[0] == BWC_CMD_SEARCH) {
+    buf[len] = '\0';
+    if (upstream_path != NULL) {
+      upstream_proxy(buf, len);
+    } else {
+      send_search_results(client_sock, buf + 1);
+    }
+  } else if (buf[0] == BWC_CMD_HANDOVER) {
+    if (upstream_path != NULL) {
+      syslog(LOG_WARNING, "Relays do not support handovers");
+    } else if (handover() == 0) {
+      PROBE1(command__done, 0);
+      exit(0);
+    }
+  }
+  if (! keep) {
+    close(client_sock);
+  }
+  client_sock = -1;
+  PROBE1(command__done, keep);
+}
+
+int main (int argc, char **argv) {
+  struct sockaddr_un client_addr;
+  socklen_t client_addr_size;
+  struct pollfd pfds[2 + MESSAGE_COUNT];
+  int i, nfds;
+
+  argp_parse(&argp, argc, argv, 0, 0, 0);
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGTERM, terminate);
+  signal(SIGINT, terminate);
+  signal(SIGQUIT, terminate);
+  openlog(PROGRAM_NAME, LOG_PID | log_stderr, 0);
+
+  if (take_over && upstream_path != NULL) {
+    syslog(LOG_ERR, "Relays do not support handovers");
+    return -1;
+  }
+  timer_wheel_init(&timers, ticks_now());
+  for (i = 0; i < MESSAGE_COUNT; i++) {
+    timer_init(&(stream_timers[i]), stream_expire, NULL);
+    upstream_streams[i].sock = -1;
+  }
+  for (i = 0; i < LISTENER_COUNT; i++) {
+    message_listeners[i].sock = -1;
+    timer_init(&(message_listeners[i].heartbeat), heartbeat,
+               &(message_listeners[i]));
+    stream_listeners[i].sock = -1;
+    stream_listeners[i].msg = NULL;
+  }
+
+  if (archive_path != NULL && archive_open() < 0) {
+    return -1;
+  }
+  if (capture_path != NULL && capture_open() < 0) {
+    return -1;
+  }
+#ifdef HAVE_OPUS
+  if (room_mix) {
+    memset(&room, 0, sizeof(room));
+    strcpy(room.nick, "room");
+    room.type = BWC_MESSAGE_AUDIO;
+    room.data_len = mixer_init(room.data, sizeof(room.data));
+    if (room.data_len == 0) {
+      return -1;
+    }
+    timer_init(&room_timer, room_tick, NULL);
+    timer_add(&timers, &room_timer, 1);
+  }
+#endif
+  if (take_over) {
+    /* The history is handed over along with the rest. */
+    if (take_over_state() < 0) {
+      return -1;
+    }
+  } else {
+    history = history_map();
+    if (history == NULL) {
+      syslog(LOG_ERR, "Failed to set up the message history");
+      return -1;
+    }
+    history->seq = 0;
+    history->oldest = 0;
+    for (i = 0; i < MESSAGE_COUNT; i++) {
+      history->messages[i].type = BWC_MESSAGE_NONE;
+    }
+    if (listen_socket() < 0) {
+      return -1;
+    }
+  }
+  /* Records appended by a previous server are indexed as well. */
+  if (archive_fd != -1 && archive_scan() < 0) {
+    cleanup();
+    return -1;
+  }
+  if (upstream_path != NULL && upstream_connect() < 0) {
+    cleanup();
+    return -1;
+  }
+  /* Pending clients are accepted until there are none left. */
+  if (fcntl(server_sock, F_SETFL,
+            fcntl(server_sock, F_GETFL) | O_NONBLOCK) < 0) {
+    syslog(LOG_ERR, "fcntl() failure: %s", strerror(errno));
+    cleanup();
+    return -1;
+  }
+  while (1) {
+    long next_tick = timer_next(&timers), timeout;
+    if (capture != NULL) {
+      /* Write out the records before possibly waiting for a while. */
+      fflush(capture);
+    }
+    pfds[0].fd = server_sock;
+    pfds[0].events = POLLIN;
+    pfds[0].revents = 0;
+    nfds = 1;
+    if (upstream_path != NULL) {
+      pfds[1].fd = upstream_sock;
+      pfds[1].events = POLLIN;
+      pfds[1].revents = 0;
       for (i = 0; i < MESSAGE_COUNT; i++) {
-        if (messages[i].type == BWC_MESSAGE_AUDIO &&
-            strcmp(messages[i].nick, buf + 1) == 0) {
-          msg = &(messages[i]);
-          break;
+        /* Unused slots are ignored by poll(2). */
+        pfds[2 + i].fd = upstream_streams[i].sock;
+        pfds[2 + i].events = POLLIN;
+        pfds[2 + i].revents = 0;
+      }
+      nfds = 2 + MESSAGE_COUNT;
+    }
+    timeout = next_tick < 0 ? -1 : next_tick * TIMER_TICK_MS;
+    if (audio_count > 0 || dump_count > 0) {
+      /* Only check for higher priority work. */
+      timeout = 0;
+    }
+    if (poll(pfds, nfds, timeout) < 0 && errno != EINTR) {
+      syslog(LOG_ERR, "poll() failure: %s", strerror(errno));
+      return -1;
+    }
+    timer_advance(&timers, ticks_now());
+    if (upstream_path != NULL) {
+      if (pfds[1].revents) {
+        upstream_receive();
+      }
+      for (i = 0; i < MESSAGE_COUNT; i++) {
+        if (pfds[2 + i].revents && upstream_streams[i].sock != -1) {
+          upstream_stream_receive(i);
         }
       }
-      if (msg == NULL) {
-        close(client_sock);
+    }
+    for (i = 0; (pfds[0].revents & POLLIN) && i < ACCEPT_BATCH; i++) {
+      client_addr_size = sizeof(client_addr);
+      PROBE(accept__start);
+      client_sock = accept(server_sock,
+                           (struct sockaddr *)&client_addr,
+                           &client_addr_size);
+      PROBE1(accept__done, client_sock);
+      if (client_sock < 0) {
         client_sock = -1;
-      } else {
-        for (i = 0; i < LISTENER_COUNT; i++) {
-          if (stream_listeners[i].sock == -1) {
-            stream_listeners[i].sock = client_sock;
-            stream_listeners[i].msg = msg;
-
-            /* Send the header at once. */
-            len = write(stream_listeners[i].sock,
-                        msg->data,
-                        msg->data_len);
-            if (len < (ssize_t)(msg->data_len)) {
-              close(stream_listeners[i].sock);
-              stream_listeners[i].sock = -1;
-              stream_listeners[i].msg = NULL;
-            }
-            break;
-          }
-        }
-        if (i == LISTENER_COUNT) {
-          close(client_sock);
-          client_sock = -1;
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+          break;
         }
+        syslog(LOG_ERR, "accept() failure: %s", strerror(errno));
+        close(server_sock);
+        return -1;
       }
+      handle_client();
+    }
+    if (audio_count > 0) {
+      audio_fanout(AUDIO_BUDGET);
+    }
+    if (dump_count > 0) {
+      dump_next();
     }
   }
   return 0;
@@ -0,0 +1,26 @@
+/**
+   @file capture.h
+   @brief The traffic capture format
+   @author defanor <defanor@thunix.net>
+   @date 2024
+   @copyright MIT license
+*/
+
+/* A capture file, written by bwchat-server --capture and read by
+   bwchat-replay, starts with this magic string, followed by records.
+   The format is not portable across architectures. */
+#define CAPTURE_MAGIC "bwchat-capture-1"
+#define CAPTURE_MAGIC_LENGTH 16
+
+/* A record header, followed by len bytes of a command as it was read
+   from a client. A zero len marks the closing of a listener
+   connection. ADD_MESSAGE commands are compacted: the message is
+   stored as BWC_MESSAGE_HEADER_LENGTH bytes of its header, its
+   data_len, and data_len bytes of data. */
+struct capture_record {
+  /* Microseconds since the capture start */
+  unsigned long usec;
+  /* The connection (its server-side descriptor) */
+  int conn;
+  unsigned int len;
+};
@@ -0,0 +1,259 @@
+/**
+   @file mixer.c
+   @brief Mixing of Opus audio streams into a single one
+   @author defanor <defanor@thunix.net>
+   @date 2024
+   @copyright MIT license
+*/
+
+/*
+  https://www.rfc-editor.org/rfc/rfc7845 -- Ogg Encapsulation for the
+  Opus Audio Codec
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <syslog.h>
+#include <opus/opus.h>
+
+#include "bwchat.h"
+#include "ogg.h"
+#include "mixer.h"
+
+#define MIXER_RATE 48000
+#define MIXER_FRAME (MIXER_RATE / 1000 * MIXER_FRAME_MS)
+#define MIXER_MAX_FRAMES 16
+#define MIXER_MAX_PACKET 1500
+#define MIXER_BITRATE 32000
+/* The longest Opus packet, in samples */
+#define MIXER_MAX_DECODED (MIXER_RATE / 1000 * 120)
+/* Up to 2 seconds of decoded audio are buffered per stream, and a
+   stream is only mixed in once enough of it is buffered to cover the
+   gaps between its chunks (of 500 ms with bwchat.js). */
+#define MIXER_BUFFER (MIXER_RATE * 2)
+#define MIXER_PREBUFFER (MIXER_RATE * 3 / 4)
+/* Frames with a lower RMS level than MIXER_SILENCE_LEVEL are silent,
+   and a stream is left out of the mix after MIXER_HOLD_FRAMES of
+   those. The level of the rest is adjusted towards
+   MIXER_TARGET_LEVEL, over about MIXER_GAIN_FRAMES. */
+#define MIXER_SILENCE_LEVEL 300.0
+#define MIXER_HOLD_FRAMES 10
+#define MIXER_TARGET_LEVEL 3000.0
+#define MIXER_GAIN_FRAMES 50
+#define MIXER_MIN_GAIN 0.25
+#define MIXER_MAX_GAIN 4.0
+
+struct mixer_stream {
+  struct ogg_reader reader;
+  OpusDecoder *decoder;
+  int channels;
+  /* Decoded mono audio, a ring buffer */
+  opus_int16 buf[MIXER_BUFFER];
+  size_t buf_start, buf_len;
+  int playing;
+  /* Frames left until the stream is considered silent */
+  int hold;
+  /* The smoothed RMS level of the stream's non-silent frames */
+  double level;
+};
+
+static struct mixer_stream streams[BWC_MESSAGE_COUNT];
+static OpusEncoder *encoder = NULL;
+static struct ogg_writer writer;
+static unsigned long granule = 0;
+
+size_t mixer_init (char *buf, size_t size) {
+  unsigned char head[19], tags[22];
+  size_t head_len, tags_len, len;
+  opus_int32 lookahead = 0;
+  int i, err;
+  for (i = 0; i < BWC_MESSAGE_COUNT; i++) {
+    mixer_stop(i);
+  }
+  encoder = opus_encoder_create(MIXER_RATE, 1, OPUS_APPLICATION_VOIP, &err);
+  if (encoder == NULL) {
+    syslog(LOG_ERR, "Failed to create an Opus encoder: %s",
+           opus_strerror(err));
+    return 0;
+  }
+  opus_encoder_ctl(encoder, OPUS_SET_BITRATE(MIXER_BITRATE));
+  opus_encoder_ctl(encoder, OPUS_GET_LOOKAHEAD(&lookahead));
+  granule = lookahead;
+  ogg_writer_init(&writer, (unsigned long)time(NULL));
+
+  /* The identification header: version 1, mono, pre-skip, input
+     sample rate, no output gain, and channel mapping family 0. */
+  memcpy(head, "OpusHead", 8);
+  head[8] = 1;
+  head[9] = 1;
+  head[10] = lookahead & 0xff;
+  head[11] = (lookahead >> 8) & 0xff;
+  head[12] = MIXER_RATE & 0xff;
+  head[13] = (MIXER_RATE >> 8) & 0xff;
+  head[14] = (MIXER_RATE >> 16) & 0xff;
+  head[15] = 0;
+  head[16] = 0;
+  head[17] = 0;
+  head[18] = 0;
+  /* The comment header: a vendor string, and no comments. */
+  memcpy(tags, "OpusTags", 8);
+  tags[8] = 6;
+  tags[9] = 0;
+  tags[10] = 0;
+  tags[11] = 0;
+  memcpy(tags + 12, "bwchat", 6);
+  memset(tags + 18, 0, 4);
+
+  len = sizeof(head);
+  head_len = ogg_write(&writer, buf, size, head, &len, 1, 0, OGG_BOS);
+  len = sizeof(tags);
+  tags_len = head_len == 0 ? 0 :
+    ogg_write(&writer, buf + head_len, size - head_len, tags, &len, 1, 0, 0);
+  return tags_len == 0 ? 0 : head_len + tags_len;
+}
+
+/* Handles a packet of a stream: sets up a decoder on its header, or
+   buffers the decoded audio. */
+static void mixer_packet (void *ctx, const unsigned char *p, size_t len) {
+  static opus_int16 pcm[MIXER_MAX_DECODED * 2];
+  struct mixer_stream *s = ctx;
+  opus_int16 sample;
+  int n, i, err;
+  if (len >= 19 && memcmp(p, "OpusHead", 8) == 0) {
+    if (s->decoder != NULL) {
+      opus_decoder_destroy(s->decoder);
+      s->decoder = NULL;
+    }
+    if (p[18] != 0 || p[9] < 1 || p[9] > 2) {
+      syslog(LOG_WARNING, "Not mixing an unsupported Opus stream");
+      return;
+    }
+    s->channels = p[9];
+    s->decoder = opus_decoder_create(MIXER_RATE, s->channels, &err);
+    if (s->decoder == NULL) {
+      syslog(LOG_ERR, "Failed to create an Opus decoder: %s",
+             opus_strerror(err));
+    }
+    return;
+  }
+  if (s->decoder == NULL || (len >= 8 && memcmp(p, "OpusTags", 8) == 0)) {
+    return;
+  }
+  n = opus_decode(s->decoder, p, len, pcm, MIXER_MAX_DECODED, 0);
+  if (n < 0) {
+    syslog(LOG_DEBUG, "Failed to decode an Opus packet: %s",
+           opus_strerror(n));
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    sample = s->channels == 2 ? (pcm[i * 2] + pcm[i * 2 + 1]) / 2 : pcm[i];
+    if (s->buf_len == MIXER_BUFFER) {
+      /* Drop the oldest sample, to keep the delay bounded. */
+      s->buf_start = (s->buf_start + 1) % MIXER_BUFFER;
+      s->buf_len--;
+    }
+    s->buf[(s->buf_start + s->buf_len) % MIXER_BUFFER] = sample;
+    s->buf_len++;
+  }
+}
+
+void mixer_feed (int slot, const char *data, size_t len) {
+  ogg_read(&(streams[slot].reader), data, len, mixer_packet,
+           &(streams[slot]));
+}
+
+void mixer_stop (int slot) {
+  struct mixer_stream *s = &(streams[slot]);
+  if (s->decoder != NULL) {
+    opus_decoder_destroy(s->decoder);
+    s->decoder = NULL;
+  }
+  ogg_reader_init(&(s->reader));
+  s->buf_start = 0;
+  s->buf_len = 0;
+  s->playing = 0;
+  s->hold = 0;
+  s->level = MIXER_TARGET_LEVEL;
+}
+
+/* Adds buffered audio of a stream to the mix, frame by frame, with
+   its gain applied, and unless it is silent. */
+static void mixer_add (struct mixer_stream *s, double *mix, size_t samples) {
+  size_t i, j, n;
+  double sum, level, gain;
+  for (i = 0; i < samples; i += MIXER_FRAME) {
+    n = s->buf_len < MIXER_FRAME ? s->buf_len : MIXER_FRAME;
+    for (j = 0, sum = 0; j < n; j++) {
+      sum += (double)s->buf[(s->buf_start + j) % MIXER_BUFFER] *
+        s->buf[(s->buf_start + j) % MIXER_BUFFER];
+    }
+    level = n > 0 ? sqrt(sum / n) : 0;
+    if (level >= MIXER_SILENCE_LEVEL) {
+      s->level += (level - s->level) / MIXER_GAIN_FRAMES;
+      s->hold = MIXER_HOLD_FRAMES;
+    } else if (s->hold > 0) {
+      s->hold--;
+    }
+    if (s->hold > 0) {
+      gain = MIXER_TARGET_LEVEL / s->level;
+      if (gain < MIXER_MIN_GAIN) {
+        gain = MIXER_MIN_GAIN;
+      } else if (gain > MIXER_MAX_GAIN) {
+        gain = MIXER_MAX_GAIN;
+      }
+      for (j = 0; j < n; j++) {
+        mix[i + j] += gain * s->buf[(s->buf_start + j) % MIXER_BUFFER];
+      }
+    }
+    s->buf_start = (s->buf_start + n) % MIXER_BUFFER;
+    s->buf_len -= n;
+    if (n < MIXER_FRAME) {
+      /* Ran out of audio: buffer some again before resuming. */
+      s->playing = 0;
+      break;
+    }
+  }
+}
+
+size_t mixer_mix (char *page, size_t size, int frames) {
+  static double mix[MIXER_FRAME * MIXER_MAX_FRAMES];
+  static unsigned char packets[MIXER_MAX_PACKET * MIXER_MAX_FRAMES];
+  opus_int16 pcm[MIXER_FRAME];
+  size_t lens[MIXER_MAX_FRAMES], samples, used = 0, i;
+  double v;
+  int f, n;
+  if (frames > MIXER_MAX_FRAMES) {
+    frames = MIXER_MAX_FRAMES;
+  }
+  samples = frames * MIXER_FRAME;
+  memset(mix, 0, sizeof(mix[0]) * samples);
+  for (i = 0; i < BWC_MESSAGE_COUNT; i++) {
+    if (! streams[i].playing && streams[i].buf_len >= MIXER_PREBUFFER) {
+      streams[i].playing = 1;
+    }
+    if (streams[i].playing) {
+      mixer_add(&(streams[i]), mix, samples);
+    }
+  }
+  if (page == NULL || encoder == NULL) {
+    return 0;
+  }
+  for (f = 0; f < frames; f++) {
+    for (i = 0; i < MIXER_FRAME; i++) {
+      v = mix[f * MIXER_FRAME + i];
+      pcm[i] = v > 32767 ? 32767 : v < -32768 ? -32768 : (opus_int16)v;
+    }
+    n = opus_encode(encoder, pcm, MIXER_FRAME, packets + used,
+                    MIXER_MAX_PACKET);
+    if (n < 0) {
+      syslog(LOG_ERR, "Failed to encode the mix: %s", opus_strerror(n));
+      return 0;
+    }
+    lens[f] = n;
+    used += n;
+  }
+  granule += samples;
+  return ogg_write(&writer, page, size, packets, lens, frames, granule, 0);
+}
@@ -0,0 +1,23 @@
+/**
+   @file mixer.h
+   @brief Mixing of Opus audio streams into a single one
+   @author defanor <defanor@thunix.net>
+   @date 2024
+   @copyright MIT license
+*/
+
+/* Audio is mixed in frames of this many milliseconds. */
+#define MIXER_FRAME_MS 20
+
+/* Sets up the encoder, and writes the header pages of the mixed
+   stream into buf. Returns their length, or 0 on failure. */
+size_t mixer_init (char *buf, size_t size);
+/* Passes a piece of an Ogg/Opus stream, in the given slot, to the
+   mixer. */
+void mixer_feed (int slot, const char *data, size_t len);
+/* Forgets a stream, once it is over. */
+void mixer_stop (int slot);
+/* Mixes the given number of frames of the streams, and writes them
+   into a page. With a NULL page, the frames are only consumed.
+   Returns the page length, or 0 if nothing is written. */
+size_t mixer_mix (char *page, size_t size, int frames);
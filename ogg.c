@@ -0,0 +1,185 @@
+/**
+   @file ogg.c
+   @brief Minimal Ogg page reading and writing
+   @author defanor <defanor@thunix.net>
+   @date 2024
+   @copyright MIT license
+*/
+
+#include <string.h>
+
+#include "ogg.h"
+
+static unsigned long crc_table[256];
+static int crc_ready = 0;
+
+/* The CRC is the one of RFC 3533: the 0x04c11db7 polynomial, not
+   reflected, with zero initial and final values. */
+static unsigned long ogg_crc (const unsigned char *p, size_t len) {
+  unsigned long crc = 0, r;
+  size_t i;
+  int j;
+  if (! crc_ready) {
+    for (i = 0; i < 256; i++) {
+      r = (unsigned long)i << 24;
+      for (j = 0; j < 8; j++) {
+        r = (r & 0x80000000UL) ? (r << 1) ^ 0x04c11db7UL : r << 1;
+      }
+      crc_table[i] = r & 0xffffffffUL;
+    }
+    crc_ready = 1;
+  }
+  for (i = 0; i < len; i++) {
+    crc = ((crc << 8) ^ crc_table[((crc >> 24) ^ p[i]) & 0xff]) & 0xffffffffUL;
+  }
+  return crc;
+}
+
+static unsigned long get_le32 (const unsigned char *p) {
+  return (unsigned long)p[0] | (unsigned long)p[1] << 8 |
+    (unsigned long)p[2] << 16 | (unsigned long)p[3] << 24;
+}
+
+static void put_le (unsigned char *p, unsigned long x, int bytes) {
+  int i;
+  for (i = 0; i < bytes; i++) {
+    p[i] = x & 0xff;
+    x >>= 8;
+  }
+}
+
+void ogg_reader_init (struct ogg_reader *r) {
+  r->page_len = 0;
+  r->packet_len = 0;
+  r->packet_lost = 0;
+}
+
+/* Checks a complete page, and passes the packets it completes on. */
+static void ogg_page (struct ogg_reader *r, size_t len,
+                      void (*packet) (void *ctx, const unsigned char *p,
+                                      size_t len),
+                      void *ctx)
+{
+  unsigned char *page = r->page, lace;
+  unsigned long crc = get_le32(page + 22);
+  size_t body = OGG_HEADER_LENGTH + page[26];
+  int i;
+  put_le(page + 22, 0, 4);
+  if (ogg_crc(page, len) != crc) {
+    return;
+  }
+  if (page[5] & OGG_BOS) {
+    r->packet_len = 0;
+    r->packet_lost = 0;
+  } else if (! (page[5] & OGG_CONTINUED)) {
+    /* A packet left incomplete is lost. */
+    r->packet_len = 0;
+    r->packet_lost = 0;
+  } else if (r->packet_len == 0) {
+    /* The continuation of a packet that started before we joined. */
+    r->packet_lost = 1;
+  }
+  for (i = 0; i < page[26]; i++) {
+    lace = page[OGG_HEADER_LENGTH + i];
+    if (! r->packet_lost) {
+      if (r->packet_len + lace > sizeof(r->packet)) {
+        r->packet_lost = 1;
+      } else {
+        memcpy(r->packet + r->packet_len, page + body, lace);
+        r->packet_len += lace;
+      }
+    }
+    body += lace;
+    if (lace < 255) {
+      if (! r->packet_lost) {
+        packet(ctx, r->packet, r->packet_len);
+      }
+      r->packet_len = 0;
+      r->packet_lost = 0;
+    }
+  }
+}
+
+void ogg_read (struct ogg_reader *r, const char *data, size_t len,
+               void (*packet) (void *ctx, const unsigned char *p,
+                               size_t len),
+               void *ctx)
+{
+  size_t n, i, total;
+  do {
+    n = sizeof(r->page) - r->page_len;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(r->page + r->page_len, data, n);
+    r->page_len += n;
+    data += n;
+    len -= n;
+    while (r->page_len >= 4) {
+      if (memcmp(r->page, "OggS", 4) != 0) {
+        /* Skip to the next capture pattern. */
+        for (i = 1; i + 4 <= r->page_len &&
+               memcmp(r->page + i, "OggS", 4) != 0; i++);
+        memmove(r->page, r->page + i, r->page_len - i);
+        r->page_len -= i;
+        continue;
+      }
+      if (r->page_len < OGG_HEADER_LENGTH ||
+          r->page_len < OGG_HEADER_LENGTH + (size_t)r->page[26]) {
+        break;
+      }
+      total = OGG_HEADER_LENGTH + r->page[26];
+      for (i = 0; i < r->page[26]; i++) {
+        total += r->page[OGG_HEADER_LENGTH + i];
+      }
+      if (r->page_len < total) {
+        break;
+      }
+      ogg_page(r, total, packet, ctx);
+      memmove(r->page, r->page + total, r->page_len - total);
+      r->page_len -= total;
+    }
+  } while (len > 0);
+}
+
+void ogg_writer_init (struct ogg_writer *w, unsigned long serial) {
+  w->serial = serial;
+  w->seq = 0;
+}
+
+size_t ogg_write (struct ogg_writer *w, char *page, size_t size,
+                  const unsigned char *data, const size_t *lens, int count,
+                  unsigned long granule, int flags)
+{
+  unsigned char *p = (unsigned char *)page;
+  size_t segments = 0, body = 0, len, total, pos;
+  int i;
+  for (i = 0; i < count; i++) {
+    segments += lens[i] / 255 + 1;
+    body += lens[i];
+  }
+  total = OGG_HEADER_LENGTH + segments + body;
+  if (segments > 255 || total > size) {
+    return 0;
+  }
+  memcpy(p, "OggS", 4);
+  p[4] = 0;
+  p[5] = flags;
+  put_le(p + 6, granule, 4);
+  /* The upper half of the 64-bit granule position */
+  put_le(p + 10, (granule >> 16) >> 16, 4);
+  put_le(p + 14, w->serial, 4);
+  put_le(p + 18, w->seq++, 4);
+  put_le(p + 22, 0, 4);
+  p[26] = segments;
+  pos = OGG_HEADER_LENGTH;
+  for (i = 0; i < count; i++) {
+    for (len = lens[i]; len >= 255; len -= 255) {
+      p[pos++] = 255;
+    }
+    p[pos++] = len;
+  }
+  memcpy(p + pos, data, body);
+  put_le(p + 22, ogg_crc(p, total), 4);
+  return total;
+}
@@ -0,0 +1,51 @@
+/**
+   @file ogg.h
+   @brief Minimal Ogg page reading and writing
+   @author defanor <defanor@thunix.net>
+   @date 2024
+   @copyright MIT license
+*/
+
+/*
+  https://www.rfc-editor.org/rfc/rfc3533 -- The Ogg Encapsulation Format
+*/
+
+#define OGG_HEADER_LENGTH 27
+#define OGG_PAGE_MAX (OGG_HEADER_LENGTH + 255 + 255 * 255)
+#define OGG_CONTINUED 0x01
+#define OGG_BOS 0x02
+#define OGG_EOS 0x04
+
+/* Reassembles packets of a single logical stream from its pages,
+   which may arrive in arbitrary pieces. Packets longer than
+   OGG_PAGE_MAX are dropped. */
+struct ogg_reader {
+  unsigned char page[OGG_PAGE_MAX];
+  size_t page_len;
+  unsigned char packet[OGG_PAGE_MAX];
+  size_t packet_len;
+  /* Set while the rest of a packet is being skipped */
+  int packet_lost;
+};
+
+/* Writes pages of a single logical stream. */
+struct ogg_writer {
+  unsigned long serial;
+  unsigned long seq;
+};
+
+void ogg_reader_init (struct ogg_reader *r);
+/* Feeds data to a reader, calling the packet callback for each
+   complete packet. A page with the BOS flag starts the stream
+   anew. */
+void ogg_read (struct ogg_reader *r, const char *data, size_t len,
+               void (*packet) (void *ctx, const unsigned char *p,
+                               size_t len),
+               void *ctx);
+void ogg_writer_init (struct ogg_writer *w, unsigned long serial);
+/* Writes count packets, stored one after another in data, into a
+   single page. Returns the page length, or 0 if it does not fit into
+   size bytes, or into a page. */
+size_t ogg_write (struct ogg_writer *w, char *page, size_t size,
+                  const unsigned char *data, const size_t *lens, int count,
+                  unsigned long granule, int flags);
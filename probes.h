@@ -0,0 +1,26 @@
+/**
+   @file probes.h
+   @brief Static tracepoints
+   @author defanor <defanor@thunix.net>
+   @date 2024
+   @copyright MIT license
+*/
+
+/* USDT (SystemTap-compatible) probes of the "bwchat" provider,
+   available with configure --enable-probes, and compiled out
+   otherwise. Phases are marked with *__start and *__done probe pairs,
+   so that a tracer (bpftrace, perf, stap) can time them using its own
+   timestamps, without extra clock readings here. */
+
+#ifdef ENABLE_PROBES
+#include <sys/sdt.h>
+#define PROBE(name) DTRACE_PROBE(bwchat, name)
+#define PROBE1(name, a) DTRACE_PROBE1(bwchat, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(bwchat, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(bwchat, name, a, b, c)
+#else
+#define PROBE(name) do { } while (0)
+#define PROBE1(name, a) do { } while (0)
+#define PROBE2(name, a, b) do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+#endif
@@ -0,0 +1,192 @@
+/**
+   @file search.c
+   @brief An inverted index for message search
+   @author defanor <defanor@thunix.net>
+   @date 2024
+   @copyright MIT license
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "search.h"
+
+#define SEARCH_INITIAL_SIZE 1024
+
+/* Token characters: ASCII letters and digits (case-insensitive), and
+   all non-ASCII bytes, so that UTF-8 words are kept intact. */
+static int token_char (unsigned char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+    (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+/* Reads the next token, starting from *pos; returns its length, or 0
+   if there are no more tokens. Long tokens are truncated. */
+static size_t next_token (const char *text, size_t len, size_t *pos,
+                          char *token)
+{
+  size_t tlen = 0;
+  while (*pos < len) {
+    while (*pos < len && ! token_char(text[*pos])) {
+      (*pos)++;
+    }
+    tlen = 0;
+    while (*pos < len && token_char(text[*pos])) {
+      if (tlen < SEARCH_TOKEN_LENGTH - 1) {
+        char c = text[*pos];
+        token[tlen++] = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+      }
+      (*pos)++;
+    }
+    /* Single characters are not worth indexing. */
+    if (tlen > 1) {
+      token[tlen] = '\0';
+      return tlen;
+    }
+  }
+  return 0;
+}
+
+/* FNV-1a */
+static unsigned long token_hash (const char *token) {
+  unsigned long h = 2166136261UL;
+  while (*token) {
+    h = ((h ^ (unsigned char)*token++) * 16777619UL) & 0xffffffffUL;
+  }
+  return h;
+}
+
+static struct search_postings *
+lookup (const struct search_index *idx, const char *token) {
+  size_t i = token_hash(token) & (idx->size - 1);
+  while (idx->table[i].token != NULL &&
+         strcmp(idx->table[i].token, token) != 0) {
+    i = (i + 1) & (idx->size - 1);
+  }
+  return &(idx->table[i]);
+}
+
+static int grow (struct search_index *idx) {
+  struct search_index bigger;
+  size_t i;
+  bigger.size = idx->size * 2;
+  bigger.used = idx->used;
+  bigger.table = calloc(bigger.size, sizeof(struct search_postings));
+  if (bigger.table == NULL) {
+    return -1;
+  }
+  for (i = 0; i < idx->size; i++) {
+    if (idx->table[i].token != NULL) {
+      *lookup(&bigger, idx->table[i].token) = idx->table[i];
+    }
+  }
+  free(idx->table);
+  *idx = bigger;
+  return 0;
+}
+
+int search_index_init (struct search_index *idx) {
+  idx->size = SEARCH_INITIAL_SIZE;
+  idx->used = 0;
+  idx->table = calloc(idx->size, sizeof(struct search_postings));
+  return idx->table == NULL ? -1 : 0;
+}
+
+/* Adds text tokens of a document. Identifiers should not decrease
+   between calls. */
+int search_index_add (struct search_index *idx, unsigned long id,
+                      const char *text, size_t len)
+{
+  char token[SEARCH_TOKEN_LENGTH];
+  size_t pos = 0;
+  struct search_postings *p;
+  while (next_token(text, len, &pos, token) > 0) {
+    if ((idx->used + 1) * 10 > idx->size * 7 && grow(idx) < 0) {
+      return -1;
+    }
+    p = lookup(idx, token);
+    if (p->token == NULL) {
+      p->token = malloc(strlen(token) + 1);
+      if (p->token == NULL) {
+        return -1;
+      }
+      strcpy(p->token, token);
+      p->ids = NULL;
+      p->count = 0;
+      p->size = 0;
+      idx->used++;
+    }
+    if (p->count > 0 && p->ids[p->count - 1] == id) {
+      /* Already added for this document */
+      continue;
+    }
+    if (p->count == p->size) {
+      size_t new_size = p->size ? p->size * 2 : 4;
+      unsigned long *ids = realloc(p->ids, new_size * sizeof(unsigned long));
+      if (ids == NULL) {
+        return -1;
+      }
+      p->ids = ids;
+      p->size = new_size;
+    }
+    p->ids[p->count++] = id;
+  }
+  return 0;
+}
+
+/* Finds documents containing all the query tokens, writes up to
+   max_ids of their identifiers into ids, the most recent (highest)
+   ones first; returns the number of identifiers written. */
+size_t search_index_query (const struct search_index *idx, const char *query,
+                           unsigned long *ids, size_t max_ids)
+{
+  const struct search_postings *lists[SEARCH_QUERY_TOKENS];
+  size_t pos[SEARCH_QUERY_TOKENS];
+  char token[SEARCH_TOKEN_LENGTH];
+  size_t qpos = 0, qlen = strlen(query), found = 0;
+  int n = 0, i, all_match;
+  unsigned long target;
+
+  while (n < SEARCH_QUERY_TOKENS &&
+         next_token(query, qlen, &qpos, token) > 0) {
+    lists[n] = lookup(idx, token);
+    if (lists[n]->token == NULL) {
+      /* An unknown token: nothing matches. */
+      return 0;
+    }
+    pos[n] = lists[n]->count;
+    n++;
+  }
+  if (n == 0) {
+    return 0;
+  }
+  /* Walk the lists backwards (positions are one past the current
+     element), intersecting them. */
+  while (found < max_ids) {
+    target = 0;
+    for (i = 0; i < n; i++) {
+      if (pos[i] == 0) {
+        return found;
+      }
+      if (i == 0 || lists[i]->ids[pos[i] - 1] < target) {
+        target = lists[i]->ids[pos[i] - 1];
+      }
+    }
+    all_match = 1;
+    for (i = 0; i < n; i++) {
+      while (pos[i] > 0 && lists[i]->ids[pos[i] - 1] > target) {
+        pos[i]--;
+      }
+      if (pos[i] == 0 || lists[i]->ids[pos[i] - 1] != target) {
+        all_match = 0;
+      }
+    }
+    if (all_match) {
+      ids[found++] = target;
+      for (i = 0; i < n; i++) {
+        pos[i]--;
+      }
+    }
+  }
+  return found;
+}
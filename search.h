@@ -0,0 +1,31 @@
+/**
+   @file search.h
+   @brief An inverted index for message search
+   @author defanor <defanor@thunix.net>
+   @date 2024
+   @copyright MIT license
+*/
+
+#include <stddef.h>
+
+#define SEARCH_TOKEN_LENGTH 32
+#define SEARCH_QUERY_TOKENS 8
+
+/* Identifiers of documents containing a token, in ascending order. */
+struct search_postings {
+  char *token;
+  unsigned long *ids;
+  size_t count, size;
+};
+
+/* An open addressing hash table of tokens. */
+struct search_index {
+  struct search_postings *table;
+  size_t size, used;
+};
+
+int search_index_init (struct search_index *idx);
+int search_index_add (struct search_index *idx, unsigned long id,
+                      const char *text, size_t len);
+size_t search_index_query (const struct search_index *idx, const char *query,
+                           unsigned long *ids, size_t max_ids);
@@ -0,0 +1,170 @@
+/**
+   @file sha256.c
+   @brief SHA-256, used for content-addressed file storage
+   @author defanor <defanor@thunix.net>
+   @date 2024
+   @copyright MIT license
+*/
+
+/*
+  https://doi.org/10.6028/NIST.FIPS.180-4 -- Secure Hash Standard
+*/
+
+#include <string.h>
+
+#include "sha256.h"
+
+#define ROTR(x, n) ((((x) >> (n)) | ((x) << (32 - (n)))) & 0xffffffffUL)
+
+static const unsigned long k[64] = {
+  0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL,
+  0x3956c25bUL, 0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL,
+  0xd807aa98UL, 0x12835b01UL, 0x243185beUL, 0x550c7dc3UL,
+  0x72be5d74UL, 0x80deb1feUL, 0x9bdc06a7UL, 0xc19bf174UL,
+  0xe49b69c1UL, 0xefbe4786UL, 0x0fc19dc6UL, 0x240ca1ccUL,
+  0x2de92c6fUL, 0x4a7484aaUL, 0x5cb0a9dcUL, 0x76f988daUL,
+  0x983e5152UL, 0xa831c66dUL, 0xb00327c8UL, 0xbf597fc7UL,
+  0xc6e00bf3UL, 0xd5a79147UL, 0x06ca6351UL, 0x14292967UL,
+  0x27b70a85UL, 0x2e1b2138UL, 0x4d2c6dfcUL, 0x53380d13UL,
+  0x650a7354UL, 0x766a0abbUL, 0x81c2c92eUL, 0x92722c85UL,
+  0xa2bfe8a1UL, 0xa81a664bUL, 0xc24b8b70UL, 0xc76c51a3UL,
+  0xd192e819UL, 0xd6990624UL, 0xf40e3585UL, 0x106aa070UL,
+  0x19a4c116UL, 0x1e376c08UL, 0x2748774cUL, 0x34b0bcb5UL,
+  0x391c0cb3UL, 0x4ed8aa4aUL, 0x5b9cca4fUL, 0x682e6ff3UL,
+  0x748f82eeUL, 0x78a5636fUL, 0x84c87814UL, 0x8cc70208UL,
+  0x90befffaUL, 0xa4506cebUL, 0xbef9a3f7UL, 0xc67178f2UL
+};
+
+static void sha256_block (struct sha256_ctx *ctx, const unsigned char *p) {
+  unsigned long w[64], a, b, c, d, e, f, g, h, t1, t2;
+  int i;
+  for (i = 0; i < 16; i++) {
+    w[i] = ((unsigned long)p[i * 4] << 24) |
+      ((unsigned long)p[i * 4 + 1] << 16) |
+      ((unsigned long)p[i * 4 + 2] << 8) |
+      (unsigned long)p[i * 4 + 3];
+  }
+  for (i = 16; i < 64; i++) {
+    unsigned long s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^
+      (w[i - 15] >> 3);
+    unsigned long s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^
+      (w[i - 2] >> 10);
+    w[i] = (w[i - 16] + s0 + w[i - 7] + s1) & 0xffffffffUL;
+  }
+  a = ctx->state[0];
+  b = ctx->state[1];
+  c = ctx->state[2];
+  d = ctx->state[3];
+  e = ctx->state[4];
+  f = ctx->state[5];
+  g = ctx->state[6];
+  h = ctx->state[7];
+  for (i = 0; i < 64; i++) {
+    t1 = (h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) +
+          ((e & f) ^ (~e & g)) + k[i] + w[i]) & 0xffffffffUL;
+    t2 = ((ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) +
+          ((a & b) ^ (a & c) ^ (b & c))) & 0xffffffffUL;
+    h = g;
+    g = f;
+    f = e;
+    e = (d + t1) & 0xffffffffUL;
+    d = c;
+    c = b;
+    b = a;
+    a = (t1 + t2) & 0xffffffffUL;
+  }
+  ctx->state[0] = (ctx->state[0] + a) & 0xffffffffUL;
+  ctx->state[1] = (ctx->state[1] + b) & 0xffffffffUL;
+  ctx->state[2] = (ctx->state[2] + c) & 0xffffffffUL;
+  ctx->state[3] = (ctx->state[3] + d) & 0xffffffffUL;
+  ctx->state[4] = (ctx->state[4] + e) & 0xffffffffUL;
+  ctx->state[5] = (ctx->state[5] + f) & 0xffffffffUL;
+  ctx->state[6] = (ctx->state[6] + g) & 0xffffffffUL;
+  ctx->state[7] = (ctx->state[7] + h) & 0xffffffffUL;
+}
+
+void sha256_init (struct sha256_ctx *ctx) {
+  ctx->state[0] = 0x6a09e667UL;
+  ctx->state[1] = 0xbb67ae85UL;
+  ctx->state[2] = 0x3c6ef372UL;
+  ctx->state[3] = 0xa54ff53aUL;
+  ctx->state[4] = 0x510e527fUL;
+  ctx->state[5] = 0x9b05688cUL;
+  ctx->state[6] = 0x1f83d9abUL;
+  ctx->state[7] = 0x5be0cd19UL;
+  ctx->bytes_lo = 0;
+  ctx->bytes_hi = 0;
+  ctx->block_len = 0;
+}
+
+void sha256_update (struct sha256_ctx *ctx, const void *data, size_t len) {
+  const unsigned char *p = data;
+  unsigned long lo = (ctx->bytes_lo + (len & 0xffffffffUL)) & 0xffffffffUL;
+  if (lo < ctx->bytes_lo) {
+    ctx->bytes_hi++;
+  }
+  /* Shifting twice, since size_t may be just 32 bits wide. */
+  ctx->bytes_hi += (unsigned long)((len >> 16) >> 16);
+  ctx->bytes_lo = lo;
+  if (ctx->block_len > 0) {
+    size_t n = 64 - ctx->block_len;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(ctx->block + ctx->block_len, p, n);
+    ctx->block_len += n;
+    p += n;
+    len -= n;
+    if (ctx->block_len < 64) {
+      return;
+    }
+    sha256_block(ctx, ctx->block);
+    ctx->block_len = 0;
+  }
+  while (len >= 64) {
+    sha256_block(ctx, p);
+    p += 64;
+    len -= 64;
+  }
+  memcpy(ctx->block, p, len);
+  ctx->block_len = len;
+}
+
+void sha256_final (struct sha256_ctx *ctx,
+                   unsigned char digest[SHA256_DIGEST_LENGTH])
+{
+  unsigned long bits_hi = ((ctx->bytes_hi << 3) | (ctx->bytes_lo >> 29)) &
+    0xffffffffUL;
+  unsigned long bits_lo = (ctx->bytes_lo << 3) & 0xffffffffUL;
+  int i;
+  ctx->block[ctx->block_len++] = 0x80;
+  if (ctx->block_len > 56) {
+    memset(ctx->block + ctx->block_len, 0, 64 - ctx->block_len);
+    sha256_block(ctx, ctx->block);
+    ctx->block_len = 0;
+  }
+  memset(ctx->block + ctx->block_len, 0, 56 - ctx->block_len);
+  for (i = 0; i < 4; i++) {
+    ctx->block[56 + i] = (bits_hi >> (24 - i * 8)) & 0xff;
+    ctx->block[60 + i] = (bits_lo >> (24 - i * 8)) & 0xff;
+  }
+  sha256_block(ctx, ctx->block);
+  for (i = 0; i < 32; i++) {
+    digest[i] = (ctx->state[i / 4] >> (24 - (i % 4) * 8)) & 0xff;
+  }
+}
+
+/* Writes a hexadecimal digest representation into dst, which should
+   hold at least SHA256_DIGEST_LENGTH * 2 + 1 bytes. */
+char *sha256_hex (const unsigned char digest[SHA256_DIGEST_LENGTH],
+                  char *dst)
+{
+  const char *hex = "0123456789abcdef";
+  int i;
+  for (i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+    dst[i * 2] = hex[digest[i] >> 4];
+    dst[i * 2 + 1] = hex[digest[i] & 0xf];
+  }
+  dst[SHA256_DIGEST_LENGTH * 2] = '\0';
+  return dst;
+}
@@ -0,0 +1,27 @@
+/**
+   @file sha256.h
+   @brief SHA-256, used for content-addressed file storage
+   @author defanor <defanor@thunix.net>
+   @date 2024
+   @copyright MIT license
+*/
+
+#include <stddef.h>
+
+#define SHA256_DIGEST_LENGTH 32
+
+/* 32-bit words are kept in unsigned long (at least 32 bits in C89),
+   masked where necessary. */
+struct sha256_ctx {
+  unsigned long state[8];
+  unsigned long bytes_lo, bytes_hi;
+  unsigned char block[64];
+  size_t block_len;
+};
+
+void sha256_init (struct sha256_ctx *ctx);
+void sha256_update (struct sha256_ctx *ctx, const void *data, size_t len);
+void sha256_final (struct sha256_ctx *ctx,
+                   unsigned char digest[SHA256_DIGEST_LENGTH]);
+char *sha256_hex (const unsigned char digest[SHA256_DIGEST_LENGTH],
+                  char *dst);
@@ -0,0 +1,148 @@
+/**
+   @file timer.c
+   @brief A hierarchical timer wheel
+   @author defanor <defanor@thunix.net>
+   @date 2024
+   @copyright MIT license
+*/
+
+#include <stddef.h>
+
+#include "timer.h"
+
+#define TIMER_MASK (TIMER_SLOTS - 1)
+#define TIMER_MAX_TICKS ((1UL << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1)
+
+static void list_init (struct timer *head) {
+  head->next = head;
+  head->prev = head;
+}
+
+/* Puts a timer into a slot corresponding to its expiration time. */
+static void timer_place (struct timer_wheel *w, struct timer *t) {
+  unsigned long delta = t->expires - w->now;
+  struct timer *head;
+  int level;
+  if (delta > TIMER_MAX_TICKS) {
+    /* Too far in the future: use the furthest slot. */
+    t->expires = w->now + TIMER_MAX_TICKS;
+    delta = TIMER_MAX_TICKS;
+  }
+  for (level = 0;
+       level < TIMER_LEVELS - 1 &&
+         delta >= (1UL << (TIMER_SLOT_BITS * (level + 1)));
+       level++);
+  head = &(w->slots[level][(t->expires >> (TIMER_SLOT_BITS * level)) &
+                           TIMER_MASK]);
+  t->prev = head->prev;
+  t->next = head;
+  head->prev->next = t;
+  head->prev = t;
+}
+
+void timer_wheel_init (struct timer_wheel *w, unsigned long now) {
+  int level, slot;
+  w->now = now;
+  for (level = 0; level < TIMER_LEVELS; level++) {
+    for (slot = 0; slot < TIMER_SLOTS; slot++) {
+      list_init(&(w->slots[level][slot]));
+    }
+  }
+}
+
+void timer_init (struct timer *t, void (*callback) (struct timer *t),
+                 void *data)
+{
+  t->next = NULL;
+  t->prev = NULL;
+  t->expires = 0;
+  t->callback = callback;
+  t->data = data;
+}
+
+int timer_pending (const struct timer *t) {
+  return t->next != NULL;
+}
+
+/* Schedules a timer to fire in a given number of ticks (at least
+   one), rescheduling it if it is already pending. */
+void timer_add (struct timer_wheel *w, struct timer *t, unsigned long ticks) {
+  timer_cancel(t);
+  t->expires = w->now + (ticks > 0 ? ticks : 1);
+  timer_place(w, t);
+}
+
+void timer_cancel (struct timer *t) {
+  if (t->next != NULL) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = NULL;
+    t->prev = NULL;
+  }
+}
+
+/* Advances the wheel up to a given tick, running expired timers'
+   callbacks (which may add or cancel timers). */
+void timer_advance (struct timer_wheel *w, unsigned long now) {
+  struct timer *head, *t;
+  int level;
+  while (w->now != now) {
+    w->now++;
+    /* Cascade timers from higher levels, once lower ones wrap. */
+    for (level = 1; level < TIMER_LEVELS; level++) {
+      unsigned long slot;
+      struct timer pending;
+      if ((w->now >> (TIMER_SLOT_BITS * (level - 1))) & TIMER_MASK) {
+        break;
+      }
+      slot = (w->now >> (TIMER_SLOT_BITS * level)) & TIMER_MASK;
+      head = &(w->slots[level][slot]);
+      if (head->next == head) {
+        continue;
+      }
+      /* Detach the list first, since timers may get placed back into
+         the same slot. */
+      pending.next = head->next;
+      pending.prev = head->prev;
+      pending.next->prev = &pending;
+      pending.prev->next = &pending;
+      list_init(head);
+      while (pending.next != &pending) {
+        t = pending.next;
+        pending.next = t->next;
+        t->next->prev = &pending;
+        timer_place(w, t);
+      }
+    }
+    head = &(w->slots[0][w->now & TIMER_MASK]);
+    while (head->next != head) {
+      t = head->next;
+      timer_cancel(t);
+      t->callback(t);
+    }
+  }
+}
+
+/* Returns the number of ticks until the wheel should be advanced (the
+   next lowest level timer or cascade), or -1 if there are no timers
+   at all. */
+long timer_next (const struct timer_wheel *w) {
+  int level, slot, any = 0;
+  long i;
+  for (level = 0; level < TIMER_LEVELS && ! any; level++) {
+    for (slot = 0; slot < TIMER_SLOTS && ! any; slot++) {
+      any = w->slots[level][slot].next != &(w->slots[level][slot]);
+    }
+  }
+  if (! any) {
+    return -1;
+  }
+  for (i = 1; i <= TIMER_SLOTS; i++) {
+    unsigned long tick = w->now + i;
+    const struct timer *head = &(w->slots[0][tick & TIMER_MASK]);
+    if (head->next != head || (tick & TIMER_MASK) == 0) {
+      return i;
+    }
+  }
+  return TIMER_SLOTS;
+}
@@ -0,0 +1,37 @@
+/**
+   @file timer.h
+   @brief A hierarchical timer wheel
+   @author defanor <defanor@thunix.net>
+   @date 2024
+   @copyright MIT license
+*/
+
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS 4
+
+/* A timer, kept in a doubly linked list of its slot, so that both
+   insertion and cancellation take constant time. */
+struct timer {
+  struct timer *next, *prev;
+  unsigned long expires;
+  void (*callback) (struct timer *t);
+  void *data;
+};
+
+/* Each level's slots cover TIMER_SLOTS times as many ticks as the
+   previous level's ones; timers are moved to lower levels as their
+   expiration approaches. */
+struct timer_wheel {
+  unsigned long now;
+  struct timer slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+void timer_wheel_init (struct timer_wheel *w, unsigned long now);
+void timer_init (struct timer *t, void (*callback) (struct timer *t),
+                 void *data);
+int timer_pending (const struct timer *t);
+void timer_add (struct timer_wheel *w, struct timer *t, unsigned long ticks);
+void timer_cancel (struct timer *t);
+void timer_advance (struct timer_wheel *w, unsigned long now);
+long timer_next (const struct timer_wheel *w);